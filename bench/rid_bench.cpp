@@ -0,0 +1,430 @@
+// Benchmarks the broadcast hot paths in isolation and a full broadcast cycle against the
+// simulated controller. Run after changes to the pipeline to catch cycle time regressions.
+// Exits with an error when the batch Location encoder differs from the library.
+//
+//   rid-bench [--seconds N] [--latency-us N] [--credits N] [--load N] [--realtime PRIORITY]
+//
+// --load busies N threads at normal priority during the paced run, --realtime runs it with the
+// SCHED_FIFO profile of the transmitter. Compare the jitter of both under the same load.
+
+#include <Bluetooth.hpp>
+#include <BroadcastScheduler.hpp>
+#include <HciEventDispatcher.hpp>
+#include <LocationBatch.hpp>
+#include <OdidConversion.hpp>
+#include <SimulatedController.hpp>
+
+#include <global_include.hpp>
+#include <latency_histogram.hpp>
+#include <realtime.hpp>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps the compiler from optimizing away the work under test
+template <typename T>
+static void do_not_optimize(T& value)
+{
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+template <typename F>
+static void micro(const char* name, F&& function, int iterations = 1000000)
+{
+	// Warm up caches and branch predictors
+	for (int i = 0; i < iterations / 10; i++) {
+		function(i);
+	}
+
+	auto start = Clock::now();
+
+	for (int i = 0; i < iterations; i++) {
+		function(i);
+	}
+
+	double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations;
+	LOG("%-48s %10.1f ns/op", name, ns);
+}
+
+// Accepts every command without a controller behind it
+class NullTransport : public bt::HciTransport
+{
+public:
+	bool open() override { return true; };
+	void close() override {};
+	int fd() const override { return -1; };
+	bool send_command(uint8_t, uint16_t, const uint8_t*, uint8_t) override { return true; };
+	ssize_t read(uint8_t*, size_t) override { return 0; };
+};
+
+static mavlink_open_drone_id_location_t sample_location(int i)
+{
+	mavlink_open_drone_id_location_t location = {};
+	location.status = 2; // Airborne
+	location.direction = 9000 + i % 100;
+	location.speed_horizontal = 1250;
+	location.speed_vertical = -120;
+	location.latitude = 473977418 + i;
+	location.longitude = 85455939 - i;
+	location.altitude_barometric = 488.5f;
+	location.altitude_geodetic = 490.f;
+	location.height = 25.f;
+	location.horizontal_accuracy = 10;
+	location.vertical_accuracy = 4;
+	location.timestamp = 1234.5f;
+	return location;
+}
+
+static void run_micro_benchmarks()
+{
+	LOG(CYAN_TEXT "Micro benchmarks" NORMAL_TEXT);
+
+	mavlink_heartbeat_t heartbeat = {};
+	heartbeat.type = 2; // Quadrotor
+	mavlink_open_drone_id_system_t system = {};
+	system.operator_latitude = 473977000;
+	system.operator_longitude = 85455000;
+	system.area_count = 1;
+	mavlink_open_drone_id_operator_id_t operator_id = {};
+	strcpy(operator_id.operator_id, "FIN87astrdge12k8");
+	mavlink_open_drone_id_self_id_t self_id = {};
+	strcpy(self_id.description, "Survey flight");
+
+	ODID_UAS_Data data = {};
+
+	micro("MAVLink -> ODID_UAS_Data (all messages)", [&](int i) {
+		auto location = sample_location(i);
+		txr::convert_basic_id(heartbeat, "MFR1C123456789ABC", &data.BasicID[0]);
+		txr::convert_location(location, &data.Location);
+		txr::convert_system(system, &data.System);
+		txr::convert_operator_id(operator_id, &data.OperatorID);
+		txr::convert_self_id(self_id, &data.SelfID);
+		do_not_optimize(data);
+	});
+
+	data.OperatorIDValid = data.SelfIDValid = 1;
+	ODID_Message_encoded encoded = {};
+
+	micro("encodeBasicIDMessage", [&](int) {
+		encodeBasicIDMessage((ODID_BasicID_encoded*) &encoded, &data.BasicID[0]);
+		do_not_optimize(encoded);
+	});
+
+	micro("encodeLocationMessage", [&](int i) {
+		data.Location.Latitude = 47.3977418 + i * 1e-7;
+		encodeLocationMessage((ODID_Location_encoded*) &encoded, &data.Location);
+		do_not_optimize(encoded);
+	});
+
+	micro("encodeSystemMessage", [&](int) {
+		encodeSystemMessage((ODID_System_encoded*) &encoded, &data.System);
+		do_not_optimize(encoded);
+	});
+
+	ODID_MessagePack_data pack_data = {};
+	pack_data.SingleMessageSize = ODID_MESSAGE_SIZE;
+	pack_data.MsgPackSize = 5;
+	ODID_MessagePack_encoded pack = {};
+
+	micro("encodeMessagePack (5 messages)", [&](int) {
+		encodeMessagePack(&pack, &pack_data);
+		do_not_optimize(pack);
+	});
+
+	bt::AdvertisingDataFrame frame;
+
+	micro("build_legacy_advertising_data", [&](int) {
+		bt::Bluetooth::build_legacy_advertising_data(&frame, &encoded);
+		do_not_optimize(frame);
+	});
+
+	micro("build_extended_advertising_data", [&](int i) {
+		bt::Bluetooth::build_extended_advertising_data(&frame, i & 1, &encoded);
+		do_not_optimize(frame);
+	});
+
+	micro("build_extended_advertising_data (pack)", [&](int i) {
+		bt::Bluetooth::build_extended_advertising_data(&frame, i & 1, &pack);
+		do_not_optimize(frame);
+	});
+
+	// Command Complete for LE Set Extended Advertising Data, matched against a submitted command
+	auto transport = std::make_shared<NullTransport>();
+	bt::HciCommandQueue queue(transport);
+	bt::HciEventDispatcher dispatcher(queue);
+
+	const uint8_t complete[] = { HCI_EVENT_PKT, EVT_CMD_COMPLETE, 4, 1, 0x37, 0x20, 0x00 };
+	int completed = 0;
+
+	micro("submit + Command Complete dispatch", [&](int) {
+		queue.submit(OGF_LE_CTL, 0x0037, frame.buf, frame.length, 100, "set extended advertising data",
+			     [&completed](const bt::CommandResult&) { completed++; });
+		dispatcher.dispatch(complete, sizeof(complete));
+	});
+
+	do_not_optimize(completed);
+}
+
+// Relay mode encoding of many UAS, the library one record at a time against the batch encoder
+static bool run_location_batch()
+{
+	LOG(CYAN_TEXT "Location encoding for 1024 UAS" NORMAL_TEXT);
+
+	static constexpr size_t UAS = 1024;
+	txr::LocationBatch batch;
+
+	for (size_t i = 0; i < UAS; i++) {
+		batch.push_back(sample_location(i));
+	}
+
+	std::vector<ODID_Location_encoded> encoded(UAS);
+	std::unique_ptr<bool[]> ok(new bool[UAS]);
+	ODID_Location_data data = {};
+
+	micro("convert_location + encodeLocationMessage x1024", [&](int i) {
+		for (size_t uas = 0; uas < UAS; uas++) {
+			auto location = sample_location(uas);
+			location.latitude += i;
+			txr::convert_location(location, &data);
+			encodeLocationMessage(&encoded[uas], &data);
+		}
+
+		do_not_optimize(encoded);
+	}, 2000);
+
+	txr::LocationBatchEncoder encoder;
+
+	micro("LocationBatchEncoder x1024", [&](int i) {
+		batch.latitude[i % UAS] += 1;
+		encoder.encode(batch, encoded.data(), ok.get());
+		do_not_optimize(encoded);
+	}, 2000);
+
+	// Byte for byte against the library, including invalid and boundary values
+	size_t mismatches = txr::LocationBatchEncoder::self_test(1000000);
+
+	if (mismatches) {
+		LOG(RED_TEXT "Batch Location encoder: %zu of 1000000 records differ from the library" NORMAL_TEXT, mismatches);
+		return false;
+	}
+
+	LOG("Batch Location encoder matches the library on 1000000 records");
+	return true;
+}
+
+// Every message type on its own legacy and extended set, as in multi set mode
+static std::vector<bt::AdvertisingSet> multi_set_sets()
+{
+	std::vector<bt::AdvertisingSet> sets;
+
+	for (uint8_t handle = 0; handle < 6; handle++) {
+		sets.push_back({ .handle = handle, .legacy_pdus = handle % 2 == 0 });
+	}
+
+	return sets;
+}
+
+static void run_throughput(bt::Bluetooth& bluetooth, double seconds, bool flush_each)
+{
+	auto sets = multi_set_sets();
+	bluetooth.enable_advertising_sets(sets);
+
+	ODID_Message_encoded encoded = {};
+	std::vector<bt::AdvertisingDataFrame> frames(sets.size());
+
+	for (size_t i = 0; i < sets.size(); i++) {
+		bt::Bluetooth::build_extended_advertising_data(&frames[i], sets[i].handle, &encoded);
+	}
+
+	LatencyHistogram round_time;
+	uint64_t messages = 0;
+	uint8_t counter = 0;
+	auto start = Clock::now();
+	auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+
+	while (Clock::now() < end) {
+		auto round_start = Clock::now();
+
+		for (auto& frame : frames) {
+			bluetooth.send_advertising_data(&frame, ++counter);
+
+			if (flush_each) {
+				bluetooth.flush_advertising_data();
+			}
+		}
+
+		bluetooth.flush_advertising_data();
+		round_time.record(Clock::now() - round_start);
+		messages += frames.size();
+	}
+
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	LOG("%s: %.0f messages/s", flush_each ? "one command at a time" : "pipelined per round", messages / elapsed);
+	round_time.log("  round of 6 sets");
+}
+
+static void run_paced(bt::Bluetooth& bluetooth, double seconds)
+{
+	// Far above the default rates to load the pipeline
+	txr::ScheduleSettings settings;
+	settings.legacy = { .basic_id = 10, .location = 50, .system = 10, .operator_id = 0, .self_id = 0, .pack = 0 };
+	settings.extended = settings.legacy;
+	settings.message_spacing_ms = 0;
+
+	txr::BroadcastScheduler scheduler(settings);
+	txr::MessageType types[] = { txr::MessageType::Location, txr::MessageType::BasicId, txr::MessageType::System };
+
+	for (auto type : types) {
+		scheduler.add(type, txr::Transport::Legacy, scheduler.messages().size());
+		scheduler.add(type, txr::Transport::Extended, scheduler.messages().size());
+	}
+
+	auto sets = multi_set_sets();
+	bluetooth.enable_advertising_sets(sets);
+
+	ODID_Message_encoded encoded = {};
+	std::vector<bt::AdvertisingDataFrame> frames(sets.size());
+
+	for (size_t i = 0; i < sets.size(); i++) {
+		bt::Bluetooth::build_extended_advertising_data(&frames[i], sets[i].handle, &encoded);
+	}
+
+	double target = 0;
+
+	for (auto& message : scheduler.messages()) {
+		target += 1.0 / std::chrono::duration<double>(message.period).count();
+	}
+
+	LatencyHistogram lateness;
+	LatencyHistogram wakeup;
+	uint64_t messages = 0;
+	uint8_t counter = 0;
+	scheduler.start();
+	auto start = Clock::now();
+	auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+
+	while (Clock::now() < end) {
+		Clock::time_point when;
+		auto& message = scheduler.next(&when);
+
+		if (when > Clock::now()) {
+			sleep_until_monotonic(when);
+			wakeup.record(Clock::now() - when);
+		}
+
+		auto started = Clock::now();
+		lateness.record(started - message.deadline);
+
+		bluetooth.send_advertising_data(&frames[message.channel], ++counter);
+		bluetooth.flush_advertising_data();
+		scheduler.sent(message, started, Clock::now());
+		messages++;
+	}
+
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	LOG("paced: %.0f of %.0f messages/s", messages / elapsed, target);
+	lateness.log("  jitter (send start - deadline)");
+	wakeup.log("  wake up latency");
+}
+
+int main(int argc, char** argv)
+{
+	setbuf(stdout, NULL); // Disable stdout buffering
+
+	double seconds = 2;
+	int load = 0;
+	RealtimeSettings realtime;
+	bt::SimulatedControllerSettings sim;
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string arg = argv[i];
+
+		if (arg == "--seconds") {
+			seconds = atof(argv[i + 1]);
+
+		} else if (arg == "--latency-us") {
+			sim.command_latency_us = atoi(argv[i + 1]);
+
+		} else if (arg == "--credits") {
+			sim.command_credits = atoi(argv[i + 1]);
+
+		} else if (arg == "--load") {
+			load = atoi(argv[i + 1]);
+
+		} else if (arg == "--realtime") {
+			realtime.enabled = true;
+			realtime.priority = atoi(argv[i + 1]);
+
+		} else {
+			LOG("Usage: %s [--seconds N] [--latency-us N] [--credits N] [--load N] [--realtime PRIORITY]", argv[0]);
+			return -1;
+		}
+	}
+
+	run_micro_benchmarks();
+
+	if (!run_location_batch()) {
+		return -1;
+	}
+
+	LOG(CYAN_TEXT "Full cycle against the simulated controller" NORMAL_TEXT);
+
+	auto simulator = std::make_shared<bt::SimulatedController>(sim);
+	bt::Bluetooth bluetooth(simulator, bt::Bluetooth::generate_random_mac_address());
+
+	if (!bluetooth.initialize()) {
+		LOG(RED_TEXT "Failed to initialize the simulated controller" NORMAL_TEXT);
+		return -1;
+	}
+
+	run_throughput(bluetooth, seconds, true);
+	run_throughput(bluetooth, seconds, false);
+
+	// Host load competing with the paced run for the CPUs
+	std::atomic<bool> loaded {true};
+	std::vector<std::thread> hogs;
+
+	for (int i = 0; i < load; i++) {
+		hogs.emplace_back([&loaded] {
+			uint64_t spins = 0;
+
+			while (loaded.load(std::memory_order_relaxed)) {
+				do_not_optimize(++spins);
+			}
+		});
+	}
+
+	if (realtime.enabled) {
+		lock_memory();
+		set_realtime_scheduling(pthread_self(), realtime, "paced");
+		set_realtime_scheduling(bluetooth.reactor_thread(), realtime, "reactor");
+		// Stands in for the radio, which does not share the CPUs with the load
+		set_realtime_scheduling(simulator->native_handle(), realtime, "simulator");
+		prefault_stack();
+	}
+
+	LOG(CYAN_TEXT "Paced run, %d load threads, %s scheduling" NORMAL_TEXT, load, realtime.enabled ? "SCHED_FIFO" : "default");
+	run_paced(bluetooth, seconds);
+
+	loaded.store(false);
+
+	for (auto& hog : hogs) {
+		hog.join();
+	}
+
+	bluetooth.stop();
+	simulator->print_stats();
+	bluetooth.print_command_stats();
+
+	return 0;
+}
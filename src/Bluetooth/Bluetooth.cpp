@@ -1,5 +1,4 @@
 #include "Bluetooth.hpp"
-#include "print_bt_features.h"
 
 #include <global_include.hpp>
 
@@ -7,6 +6,8 @@
 #include <cstdlib>
 #include <ctime>
 #include <algorithm>
+#include <mutex>
+#include <random>
 #include <unistd.h>
 
 #include <bluetooth/bluetooth.h>
@@ -16,33 +17,112 @@
 namespace bt
 {
 
-Bluetooth::Bluetooth(const std::string& device_name)
-	: _device_name(device_name)
+Bluetooth::Bluetooth(std::shared_ptr<HciTransport> transport, const std::string& mac)
+	: _mac(mac)
+	, _transport(transport)
+	, _command_queue(transport)
+	, _dispatcher(_command_queue)
+	, _reactor(transport)
 {}
 
 void Bluetooth::stop()
 {
-	disable_legacy_advertising();
+	// Extended first, its reset also leaves persistent mode before the legacy commands are sent
 	disable_le_extended_advertising();
+	disable_legacy_advertising();
 }
 
-bool Bluetooth::initialize()
+bool Bluetooth::initialize(const std::string& cache_directory)
 {
 	LOG("Initializing Bluetooth");
-	_mac = generate_random_mac_address();
 
-	_device = hci_open();
+	if (!_transport->open()) {
+		LOG(RED_TEXT "Opening HCI transport failed!" NORMAL_TEXT);
+		return false;
+	}
+
+	// Setting the extended advertising parameters for BT4 also causes the controller to complete
+	// LE Set Extended Advertising Data without it being sent, nothing needs to be done with it
+	_dispatcher.on_unsolicited_completion(cmd_opcode_pack(OGF_LE_CTL, 0x0037), [](const CommandResult&) {});
+
+	_dispatcher.on_le_meta_event(0x12, [this](const uint8_t* params, uint8_t length) {
+		// LE Advertising Set Terminated: Status | Advertising_Handle | Connection_Handle (2) | Num_Completed_Extended_Advertising_Events
+		if (length >= 2) {
+			LOG(RED_TEXT "Advertising set %u terminated: status 0x%x" NORMAL_TEXT, params[1], params[0]);
+
+			// A train has no duration of its own, it stops with its set until the next refresh restarts both
+			if (params[1] < 64 && (_periodic_handles.load() & (1ull << params[1]))) {
+				le_set_periodic_advertising_enable(params[1], false);
+			}
+		}
+	});
+
+	_dispatcher.on_event(EVT_HARDWARE_ERROR, [](const uint8_t* params, uint8_t length) {
+		LOG(RED_TEXT "Controller hardware error: 0x%x" NORMAL_TEXT, length ? params[0] : 0);
+	});
+
+	auto on_packet = [this](const uint8_t* buf, size_t bytes_read) {
+		handle_packet(buf, bytes_read);
+	};
+
+	auto on_timeout = [this]() {
+		_command_queue.expire_timed_out();
+	};
+
+	// Without a transport nothing completes anymore, the broadcast loop must not wait for it
+	auto on_failure = [this]() {
+		_command_queue.fail_all();
+	};
+
+	// Only armed under the queue lock, a thread must never disarm the timer for a command submitted after it looked
+	_command_queue.on_deadline_changed([this](std::chrono::steady_clock::time_point deadline) {
+		_reactor.set_deadline(deadline);
+	});
 
-	if (_device < 0) {
-		LOG(RED_TEXT "hci_open() failed!" NORMAL_TEXT);
+	if (!_reactor.start(on_packet, on_timeout, on_failure)) {
 		return false;
 	}
 
 	hci_reset();
+	_reads_completed = 0;
+	read_bd_addr();
+	read_local_version_information();
+	wait_for_pending_commands();
+
+	// A controller that did not identify itself is never cached, its zero key would match any other
+	bool identified = _reads_completed == 2 && _capabilities.address != "00:00:00:00:00:00";
+
+	// Only a new controller or firmware is probed, a restart takes the rest from the cache
+	if (!identified || !_capabilities.load(cache_directory)) {
+		if (!probe_capabilities() || !identified) {
+			LOG(RED_TEXT "Controller did not answer every probe, capabilities are not cached" NORMAL_TEXT);
+
+		} else {
+			_capabilities.save(cache_directory);
+		}
+	}
+
+	_capabilities.print();
+	return true;
+}
+
+bool Bluetooth::probe_capabilities()
+{
+	_reads_completed = 0;
+	int reads = 2;
+
 	le_read_local_supported_features();
 	hci_read_local_supported_features();
+	wait_for_pending_commands();
 
-	return true;
+	// BT4 controllers reject the extended advertising commands
+	if (_capabilities.extended_advertising()) {
+		reads += 2;
+		le_read_number_of_supported_advertising_sets();
+		_capabilities.max_advertising_data_length = le_read_maximum_advertising_data_length();
+	}
+
+	return _reads_completed == reads;
 }
 
 void Bluetooth::enable_legacy_advertising()
@@ -50,8 +130,9 @@ void Bluetooth::enable_legacy_advertising()
 	// LOG("Enabling Legacy advertising");
 	uint16_t interval_ms = 20;
 	legacy_set_advertising_parameters(interval_ms);
-	legacy_set_random_address();
+	legacy_set_random_address(_mac);
 	legacy_set_advertising_enable();
+	wait_for_pending_commands();
 }
 
 void Bluetooth::enable_le_extended_advertising()
@@ -59,14 +140,16 @@ void Bluetooth::enable_le_extended_advertising()
 	// LOG("Enabling LE Extended advertising");
 	uint16_t interval_ms = 20;
 	le_set_extended_advertising_parameters(interval_ms);
-	le_set_advertising_set_random_address();
+	le_set_advertising_set_random_address(0, _mac);
 	le_set_extended_advertising_enable();
+	wait_for_pending_commands();
 }
 
 void Bluetooth::disable_legacy_advertising()
 {
 	legacy_set_advertising_disable();
 	hci_reset();
+	wait_for_pending_commands();
 }
 
 void Bluetooth::disable_le_extended_advertising()
@@ -74,54 +157,129 @@ void Bluetooth::disable_le_extended_advertising()
 	le_set_extended_advertising_disable();
 	le_remove_advertising_set();
 	hci_reset();
+	wait_for_pending_commands();
 }
 
-std::string Bluetooth::generate_random_mac_address()
+void Bluetooth::enable_advertising_sets(const std::vector<AdvertisingSet>& sets)
 {
-	auto mac = std::string(6, 'x');
+	LOG("Enabling %zu advertising sets", sets.size());
+	uint16_t interval_ms = 20;
+	uint64_t periodic_handles = 0;
+	// Clears whatever advertising mode the controller was left in
+	hci_reset();
 
-	// Seed for random number generation
-	std::srand(std::time(0));
+	for (auto& set : sets) {
+		le_set_extended_advertising_parameters(interval_ms, set.handle, set.legacy_pdus);
+		le_set_advertising_set_random_address(set.handle, _mac);
 
-	for (auto& e : mac) {
-		e = std::rand() % 255;
+		if (set.periodic_interval_ms) {
+			le_set_periodic_advertising_parameters(set.handle, set.periodic_interval_ms);
+			periodic_handles |= 1ull << set.handle;
+		}
 	}
 
-	// set to Bluetooth Random Static Address, see https://www.novelbits.io/bluetooth-address-privacy-ble/
-	// or section 1.3 of the Bluetooth specification (5.3)
-	mac[0] |= 0xC0;
+	_periodic_handles.store(periodic_handles);
 
-	return mac;
+	le_set_extended_advertising_enable(sets);
+
+	// The train starts empty, its data arrives with the first update like that of the other sets
+	for (auto& set : sets) {
+		if (set.periodic_interval_ms) {
+			le_set_periodic_advertising_enable(set.handle, true);
+		}
+	}
+
+	wait_for_pending_commands();
 }
 
-int Bluetooth::hci_open()
+void Bluetooth::refresh_advertising_sets(const std::vector<AdvertisingSet>& sets)
 {
-	struct hci_filter filter; // Host Controller Interface filter
+	le_set_extended_advertising_enable(sets);
 
-	int device_id = hci_devid(_device_name.c_str());
+	// Restarts trains that stopped with their set, enabling a running train changes nothing
+	for (auto& set : sets) {
+		if (set.periodic_interval_ms) {
+			le_set_periodic_advertising_enable(set.handle, true);
+		}
+	}
+}
 
-	if (device_id < 0) {
-		LOG(RED_TEXT "Getting device id failed" NORMAL_TEXT);
-		device_id = hci_get_route(NULL);
+void Bluetooth::change_advertising_address(const AdvertisingSet& set, const std::string& mac, bool legacy_commands)
+{
+	// The address can only change while the advertisement is disabled
+	if (legacy_commands) {
+		legacy_set_advertising_disable();
+		legacy_set_random_address(mac);
+
+	} else {
+		le_set_extended_advertising_enable({ set }, false);
+		le_set_advertising_set_random_address(set.handle, mac);
 	}
+}
 
-	int device_descriptor = hci_open_dev(device_id);
+void Bluetooth::resume_advertising(const AdvertisingSet& set, bool legacy_commands)
+{
+	if (legacy_commands) {
+		legacy_set_advertising_enable();
 
-	if (device_descriptor < 0) {
-		LOG(RED_TEXT "Device open failed" NORMAL_TEXT);
-		return -1;
+	} else {
+		le_set_extended_advertising_enable({ set });
 	}
+}
+
+void Bluetooth::update_advertising_set_data(uint8_t handle, const ODID_Message_encoded* data, uint8_t count)
+{
+	AdvertisingDataFrame frame;
+	build_extended_advertising_data(&frame, handle, data);
+	send_advertising_data(&frame, count);
+}
+
+void Bluetooth::update_advertising_set_pack(uint8_t handle, const ODID_MessagePack_encoded* pack, uint8_t count)
+{
+	AdvertisingDataFrame frame;
+	build_extended_advertising_data(&frame, handle, pack);
+	send_advertising_data(&frame, count);
+}
+
+void Bluetooth::send_advertising_data(AdvertisingDataFrame* frame, uint8_t count, CommandCallback on_complete)
+{
+	frame->buf[frame->counter_offset] = count;
+
+	const char* description = "set extended advertising data";
 
-	hci_filter_clear(&filter);
-	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
-	hci_filter_all_events(&filter);
+	if (frame->ocf == hci::LeSetAdvertisingData::OCF) {
+		description = "set legacy advertising data";
+
+	} else if (frame->ocf == hci::LeSetPeriodicAdvertisingData::OCF) {
+		description = "set periodic advertising data";
+	}
+
+	submit_command(OGF_LE_CTL, frame->ocf, frame->buf, frame->length, description, std::move(on_complete));
+}
+
+void Bluetooth::flush_advertising_data()
+{
+	wait_for_pending_commands();
+}
+
+std::string Bluetooth::generate_random_mac_address()
+{
+	// Seeded once, addresses generated within the same second must still differ
+	static std::mt19937 generator(std::random_device{}());
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto mac = std::string(6, 'x');
 
-	if (setsockopt(device_descriptor, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0) {
-		LOG(RED_TEXT "CI filter setup failed" NORMAL_TEXT);
-		return -1;
+	for (auto& e : mac) {
+		e = generator() % 255;
 	}
 
-	return device_descriptor;
+	// set to Bluetooth Random Static Address, see https://www.novelbits.io/bluetooth-address-privacy-ble/
+	// or section 1.3 of the Bluetooth specification (5.3)
+	mac[0] |= 0xC0;
+
+	return mac;
 }
 
 void Bluetooth::hci_reset()
@@ -130,14 +288,11 @@ void Bluetooth::hci_reset()
 	uint8_t ogf = OGF_HOST_CTL;
 	uint16_t ocf = 0x0003;
 
-	if (send_command(ogf, ocf, nullptr, 0)) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 500);
+	submit_command(ogf, ocf, nullptr, 0, "reset", {}, 500);
 
-		if (status) {
-			LOG(RED_TEXT "Failed to reset: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	// The reset masks LE Advertising Set Terminated, sets that time out would stop without a word
+	submit_command(hci::SetEventMask {}, "set event mask");
+	submit_command(hci::LeSetEventMask {}, "set le event mask");
 }
 
 void Bluetooth::read_le_host_support()
@@ -146,133 +301,97 @@ void Bluetooth::read_le_host_support()
 	uint8_t ogf = OGF_HOST_CTL;
 	uint16_t ocf = 0x006C; // Read LE Host Support
 
-	uint8_t resp[3] = {};
-
-	if (send_command(ogf, ocf, nullptr, 0)) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100, resp, sizeof(resp));
-
-		if (status) {
-			LOG(RED_TEXT "Failed to read le host support: error 0x%x" NORMAL_TEXT, status);
+	submit_command(ogf, ocf, nullptr, 0, "read le host support", [](const CommandResult& result) {
+		if (result.length >= 2) {
+			LOG("LE_Supported_Host: %u", result.params[0]);
+			LOG("Simultaneous_LE_Host: %u", result.params[1]);
 		}
-	}
+	});
 
-	LOG("LE_Supported_Host: %u", resp[1]);
-	LOG("Simultaneous_LE_Host: %u", resp[2]);
+	wait_for_pending_commands();
 }
 
 void Bluetooth::write_le_host_support()
 {
 	LOG("Write le host support");
-	uint8_t ogf = OGF_HOST_CTL;
-	uint16_t ocf = 0x006D; // Write LE Host Support
-
-	uint8_t buf[2] = {};
-
-	buf[0] = 1; // LE_Supported_Host
-	buf[1] = 1; // Simultaneous_LE_Host
-
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to read le host support: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	submit_command(hci::WriteLeHostSupport {}, "write le host support");
+	wait_for_pending_commands();
 }
 
 uint16_t Bluetooth::le_read_maximum_advertising_data_length()
 {
 	uint8_t ogf = OGF_LE_CTL;
 	uint16_t ocf = 0x003A;
-	uint8_t resp[3] = {};
-
-	if (send_command(ogf, ocf, nullptr, 0)) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100, resp, sizeof(resp));
+	uint16_t length = 0;
 
-		if (status) {
-			LOG(RED_TEXT "Failed to read maximum advertising length: error 0x%x" NORMAL_TEXT, status);
+	submit_command(ogf, ocf, nullptr, 0, "read maximum advertising length", [this, &length](const CommandResult& result) {
+		if (result.length >= 2) {
+			length = uint16_t(result.params[1] << 8) + uint16_t(result.params[0]);
+			_reads_completed++;
 		}
-	}
+	});
+
+	wait_for_pending_commands();
 
-	return uint16_t(resp[2] << 8) + uint16_t(resp[1]);
+	return length;
 }
 
 void Bluetooth::le_set_extended_advertising_disable()
 {
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = 0x0039;      // LE Set Extended Advertising Enable
-	uint8_t buf[] = {
-		0x00, // Enable: 0 = Advertising is disabled
-		0x00 // Number_of_Sets: 0 = Disable all advertising sets
-	};
-
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set extended advertising disable: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	// Number_of_Sets: 0 = Disable all advertising sets
+	submit_command(hci::LeSetExtendedAdvertisingEnable<0> { .enable = false, .num_sets = 0 }, "set extended advertising disable");
 }
 
-void Bluetooth::le_set_extended_advertising_enable()
+void Bluetooth::le_set_extended_advertising_enable(const std::vector<AdvertisingSet>& sets, bool enable)
 {
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = 0x0039; // LE Set Extended Advertising Enable
-	// enable(1) | num_sets(1) | AdvHandle(1*num_sets) | Duration(2*num_sets) | MaxAdvEvt(1*num_sets)
-	uint8_t buf[6] = {};
-
-	buf[0] = 1; // enable
-	buf[1] = 1; // num sets
-	buf[2] = 0; // handle
-
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
+	hci::LeSetExtendedAdvertisingEnable<MAX_ADVERTISING_SETS> command = {
+		.enable = enable,
+		.num_sets = uint8_t(std::min<size_t>(sets.size(), MAX_ADVERTISING_SETS)),
+	};
 
-		if (status) {
-			LOG(RED_TEXT "Failed to set extended advertising enable: error 0x%x" NORMAL_TEXT, status);
-		}
+	for (uint8_t i = 0; i < command.num_sets; i++) {
+		command.sets[i] = { sets[i].handle, sets[i].duration_10ms, sets[i].max_events };
 	}
+
+	submit_command(command, enable ? "set extended advertising enable" : "set extended advertising disable");
 }
 
 void Bluetooth::le_remove_advertising_set()
 {
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = 0x003C; // LE Remove Advertising Set
-	uint8_t set = 0;
+	submit_command(hci::LeRemoveAdvertisingSet { .handle = 0 }, "remove extended advertising set");
+}
 
-	if (send_command(ogf, ocf, &set, sizeof(set))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
+void Bluetooth::le_set_advertising_set_random_address(uint8_t handle, const std::string& mac)
+{
+	hci::LeSetAdvertisingSetRandomAddress command = {
+		.handle = handle,
+		.random_address = hci::address(mac),
+	};
 
-		if (status) {
-			LOG(RED_TEXT "Failed to remove extended advertising set: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	submit_command(command, "set extended advertising random address");
 }
 
-void Bluetooth::le_set_advertising_set_random_address()
+void Bluetooth::le_set_periodic_advertising_parameters(uint8_t handle, uint16_t interval_ms)
 {
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = 0x0035; // LE Set Advertising Set Random Address
-	uint8_t buf[_mac.size() + 1] = {};
+	// N * 1.25 ms, 7.5 ms at the fastest
+	uint16_t interval = std::clamp((1000 * interval_ms) / 1250, 0x0006, 0xFFFF);
+	hci::LeSetPeriodicAdvertisingParameters command = {
+		.handle = handle,
+		.interval_min = interval,
+		.interval_max = interval,
+	};
 
-	buf[0] = 0; // Advertising_Handle: Used to identify an advertising set
-	memcpy(&buf[1], _mac.data(), _mac.size());
+	submit_command(command, "set periodic advertising parameters");
+}
 
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
+void Bluetooth::le_set_periodic_advertising_enable(uint8_t handle, bool enable)
+{
+	hci::LeSetPeriodicAdvertisingEnable command = {
+		.enable = enable,
+		.handle = handle,
+	};
 
-		if (status) {
-			LOG(RED_TEXT "Failed to set extended advertising random address: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	submit_command(command, enable ? "set periodic advertising enable" : "set periodic advertising disable");
 }
 
 void Bluetooth::le_read_local_supported_features()
@@ -281,19 +400,12 @@ void Bluetooth::le_read_local_supported_features()
 	uint8_t ogf = OGF_LE_CTL;
 	uint16_t ocf = 0x0003; // LE Read Local Supported Features
 
-	if (send_command(ogf, ocf, nullptr, 0)) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t resp[9] = {};
-		uint8_t status = wait_for_command_acknowledged(opcode, 100, resp, sizeof(resp));
-
-		if (status == 0) {
-			LOG("Supported LE Bluetooth features:");
-			print_bt_le_features(&resp[1], 8);
-
-		} else {
-			LOG(RED_TEXT "Failed to set read le local supported features: error 0x%x" NORMAL_TEXT, status);
+	submit_command(ogf, ocf, nullptr, 0, "read le local supported features", [this](const CommandResult& result) {
+		if (result.length >= 8) {
+			memcpy(&_capabilities.le_features, result.params, 8);
+			_reads_completed++;
 		}
-	}
+	});
 }
 
 void Bluetooth::hci_read_local_supported_features()
@@ -302,242 +414,197 @@ void Bluetooth::hci_read_local_supported_features()
 	uint8_t ogf = OGF_INFO_PARAM;
 	uint16_t ocf = 0x0003; // Read Local Supported Features
 
-	if (send_command(ogf, ocf, nullptr, 0)) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t resp[9] = {};
-		uint8_t status = wait_for_command_acknowledged(opcode, 100, resp, sizeof(resp));
-
-		if (status == 0) {
-			LOG("Supported HCI Bluetooth features:");
-			print_bt_hci_features(&resp[1], 8);
-
-		} else {
-			LOG(RED_TEXT "Failed to set read hci local supported features: error 0x%x" NORMAL_TEXT, status);
+	submit_command(ogf, ocf, nullptr, 0, "read hci local supported features", [this](const CommandResult& result) {
+		if (result.length >= 8) {
+			memcpy(&_capabilities.hci_features, result.params, 8);
+			_reads_completed++;
 		}
-	}
+	});
 }
 
-void Bluetooth::le_set_extended_advertising_parameters(int interval_ms)
+void Bluetooth::le_read_number_of_supported_advertising_sets()
 {
-	// LOG("Setting extended advertising parameters");
 	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = 0x0036; // LE Set Extended Advertising Parameters
-	uint8_t buf[] = { 0x00, // Advertising_Handle: Used to identify an advertising set
-			  0x10, 0x00, // Advertising_Event_Properties: 0x0010 = Use legacy advertising PDUs + Non-connectable and non-scannable undirected
-			  0x00, 0x08, 0x00, // Primary_Advertising_Interval_Min: N * 0.625 ms. 0x000800 = 1280 ms
-			  0x00, 0x08, 0x00, // Primary_Advertising_Interval_Max: N * 0.625 ms. 0x000800 = 1280 ms
-			  0x07,       // Primary_Advertising_Channel_Map: 7 = all three channels enabled
-			  0x01,       // Own_Address_Type: 1 = Random Device Address
-			  0x00,       // Peer_Address_Type: 0 = Public Device Address or Public Identity Address
-			  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // Peer_Address
-			  0x00,       // Advertising_Filter_Policy: 0 = Process scan and connection requests from all devices (i.e., the White List is not in use)
-			  0x7F,       // Advertising_Tx_Power: 0x7F = Host has no preference
-			  0x01,       // Primary_Advertising_PHY: 1 = Primary advertisement PHY is LE 1M
-			  0x00,       // Secondary_Advertising_Max_Skip: 0 = AUX_ADV_IND shall be sent prior to the next advertising event
-			  0x01,       // Secondary_Advertising_PHY: 1 = Secondary advertisement PHY is LE 1M
-			  0x00,       // Advertising_SID: 0 = Value of the Advertising SID subfield in the ADI field of the PDU
-			  0x00        // Scan_Request_Notification_Enable: 0 = Scan request notifications disabled
-			};
-
-	interval_ms = std::min(std::max((1000 * interval_ms) / 625, 0x000020), 0xFFFFFF);
-	buf[3] = buf[6] = interval_ms & 0xFF;
-	buf[4] = buf[7] = (interval_ms >> 8) & 0xFF;
-	buf[5] = buf[8] = (interval_ms >> 16) & 0xFF;
-
-	buf[1] = 0x00;  // Advertising_Event_Properties: 0x0000 = Non-connectable and non-scannable undirected
-	buf[20] = 0x03; // Primary_Advertising_PHY: 3 = Primary advertisement PHY is LE Coded
-	buf[22] = 0x03; // Secondary_Advertising_PHY: 3 = Secondary advertisement PHY is LE Coded
-
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t resp[2] = {};
-		uint8_t status = wait_for_command_acknowledged(opcode, 100, resp, sizeof(resp));
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set extended advertising parameters: error 0x%x" NORMAL_TEXT, status);
+	uint16_t ocf = 0x003B; // LE Read Number of Supported Advertising Sets
 
-		} else {
-			// LOG("Selected TX Power: %u dbm", resp[1]);
-			// Setting the extended advertising parameters for BT4 also causes the controller to set
-			// extended advertising data so we must read that response here now as well
-			wait_for_command_acknowledged(htobs(cmd_opcode_pack(OGF_LE_CTL, 0x0037)), 100);
+	submit_command(ogf, ocf, nullptr, 0, "read number of supported advertising sets", [this](const CommandResult& result) {
+		if (result.length >= 1) {
+			_capabilities.num_advertising_sets = result.params[0];
+			_reads_completed++;
 		}
-	}
+	});
+
+	wait_for_pending_commands();
 }
 
-void Bluetooth::hci_le_set_extended_advertising_data(const ODID_Message_encoded* data, uint8_t count)
+void Bluetooth::read_bd_addr()
 {
-	uint16_t adv_data_hdr_size = 6; // AD len(1), Type(1), UUID(2), AppCode(1), Counter(1)
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = 0x0037;// LE Set Extended Advertising Data
-	uint8_t buf[4 + adv_data_hdr_size + ODID_MESSAGE_SIZE] = {
-		0x00,   	// Advertising_Handle: Used to identify an advertising set
-		0x03,   	// Operation: 3 = Complete extended advertising data
-		0x01,   	// Fragment_Preference: 1 = The Controller should not fragment or should minimize fragmentation of Host advertising data
-		0x00,   	// Advertising_Data_Length: The number of octets in the Advertising Data parameter
-		// BEGIN ODID
-		0x00,   	// The length of the following data field
-		0x16,   	// 16 = GAP AD Type = "Service Data - 16-bit UUID"
-		0xFA, 0xFF, // 0xFFFA = ASTM International, ASTM Remote ID
-		0x0D,   	// 0x0D = AD Application Code within the ASTM address space = Open Drone ID
-		0x00   		// xx = 8-bit message counter starting at 0x00 and wrapping around at 0xFF
-	};
-
-	buf[9] = count;
-	buf[3] = ODID_MESSAGE_SIZE + adv_data_hdr_size; // Advertising_Data_Length
-	buf[4] = ODID_MESSAGE_SIZE + adv_data_hdr_size - 1; // AD Info -- The length of the following data
-
-	memcpy(&buf[10], (uint8_t*)data, ODID_MESSAGE_SIZE);
-
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set extended advertising data: error 0x%x" NORMAL_TEXT, status);
+	uint8_t ogf = OGF_INFO_PARAM;
+	uint16_t ocf = 0x0009; // Read BD_ADDR
+
+	submit_command(ogf, ocf, nullptr, 0, "read bd addr", [this](const CommandResult& result) {
+		if (result.length >= 6) {
+			// Least significant byte first
+			char address[18];
+			snprintf(address, sizeof(address), "%02X:%02X:%02X:%02X:%02X:%02X", result.params[5], result.params[4],
+				 result.params[3], result.params[2], result.params[1], result.params[0]);
+			_capabilities.address = address;
+			_reads_completed++;
 		}
-	}
+	});
 }
 
-uint8_t Bluetooth::wait_for_command_acknowledged(uint16_t opcode, uint64_t timeout_ms, uint8_t* response_data, uint8_t response_size)
+void Bluetooth::read_local_version_information()
 {
-	uint8_t status = {};
-	uint64_t start_time = millis();
-	bool exit_loop = false;
-
-	// Handle nullptr for response and response_size
-	uint8_t* data = nullptr;
-	uint8_t size = 0;
-
-	if (response_data) {
-		data = response_data;
-		size = response_size;
+	uint8_t ogf = OGF_INFO_PARAM;
+	uint16_t ocf = 0x0001; // Read Local Version Information
+
+	submit_command(ogf, ocf, nullptr, 0, "read local version information", [this](const CommandResult& result) {
+		// HCI_Version | HCI_Revision (2) | LMP_Version | Company_Identifier (2) | LMP_Subversion (2)
+		if (result.length >= 8) {
+			_capabilities.hci_version = result.params[0];
+			_capabilities.hci_revision = result.params[1] | (result.params[2] << 8);
+			_capabilities.manufacturer = result.params[4] | (result.params[5] << 8);
+			_capabilities.lmp_subversion = result.params[6] | (result.params[7] << 8);
+			_reads_completed++;
+		}
+	});
+}
 
-	} else {
-		data = &status;
-		size = sizeof(status);
-	}
+void Bluetooth::le_set_extended_advertising_parameters(int interval_ms, uint8_t handle, bool legacy_pdus)
+{
+	// LOG("Setting extended advertising parameters");
+	uint32_t interval = hci::interval_units(interval_ms, hci::LeSetExtendedAdvertisingParameters::MAX_INTERVAL);
+	hci::LeSetExtendedAdvertisingParameters command = {
+		.handle = handle,
+		.interval_min = interval,
+		.interval_max = interval,
+	};
 
-	while (!exit_loop) {
-		CommandResponse response = read_command_response(opcode, data, size);
-		status = data[0];
-
-		switch (response) {
-		case CommandResponse::NoData:
-		case CommandResponse::InvalidPacketType:
-		case CommandResponse::InvalidOpCode:
-			// keep looping
-			break;
-
-		case CommandResponse::Error:
-		case CommandResponse::MissingData:
-		case CommandResponse::Success:
-		default:
-			exit_loop = true;
-			break;
-		}
+	// Extended PDUs at long range where the controller supports it, otherwise on LE 1M
+	if (!legacy_pdus) {
+		command.event_properties = hci::ADVERTISING_EVENT_NONCONNECTABLE;
 
-		if (millis() - start_time > timeout_ms) {
-			LOG(RED_TEXT "Timed out waiting for response" NORMAL_TEXT);
-			exit_loop = true;
+		if (_capabilities.le_coded_phy()) {
+			command.primary_phy = hci::AdvertisingPhy::LeCoded;
+			command.secondary_phy = hci::AdvertisingPhy::LeCoded;
 		}
 	}
 
-	return status;
+	submit_command(command, "set extended advertising parameters");
 }
 
-Bluetooth::CommandResponse Bluetooth::read_command_response(uint16_t opcode, uint8_t* response, int response_size)
+void Bluetooth::hci_le_set_extended_advertising_data(const ODID_Message_encoded* data, uint8_t count)
 {
-	unsigned char buf[HCI_MAX_EVENT_SIZE] = {};
+	update_advertising_set_data(0, data, count);
+	wait_for_pending_commands();
+}
 
-	ssize_t bytes_read = ::read(_device, buf, sizeof(buf));
+void Bluetooth::hci_le_set_extended_advertising_pack(const ODID_MessagePack_encoded* pack, uint8_t count)
+{
+	update_advertising_set_pack(0, pack, count);
+	wait_for_pending_commands();
+}
 
-	// Check length
-	if (bytes_read < 0) {
-		LOG(RED_TEXT "read error" NORMAL_TEXT);
-		return CommandResponse::Error;
+void Bluetooth::build_extended_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const ODID_Message_encoded* data)
+{
+	build_extended_advertising_data(frame, handle, (const uint8_t*)data, ODID_MESSAGE_SIZE);
+}
 
-	} else if (bytes_read == 0) {
-		LOG(RED_TEXT "no data available" NORMAL_TEXT);
-		return CommandResponse::NoData;
-	}
+void Bluetooth::build_extended_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const ODID_MessagePack_encoded* pack)
+{
+	build_extended_advertising_data(frame, handle, (const uint8_t*)pack, message_pack_size(pack));
+}
 
-	// Check packet type
-	if (buf[0] != HCI_EVENT_PKT) {
-		LOG(RED_TEXT "wrong packet type: %u" NORMAL_TEXT, buf[0]);
-		return CommandResponse::InvalidPacketType;
-	}
+void Bluetooth::build_periodic_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const ODID_Message_encoded* data)
+{
+	build_periodic_advertising_data(frame, handle, (const uint8_t*)data, ODID_MESSAGE_SIZE);
+}
 
-	// Points to hci event header struct
-	// | Packet Type (1 byte) | Event Code (1 byte) | Parameter Total Length (1 byte) | Event Parameters (Variable) |
-	hci_event_hdr* hdr = (hci_event_hdr*)(buf + HCI_TYPE_LEN);
-	ssize_t packet_length = hdr->plen + HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE;
+uint8_t Bluetooth::message_pack_size(const ODID_MessagePack_encoded* pack)
+{
+	// ProtoVersion/MessageType(1), SingleMessageSize(1), MsgPackSize(1), Messages
+	return 3 + pack->MsgPackSize * ODID_MESSAGE_SIZE;
+}
 
-	if (bytes_read < packet_length) {
-		LOG(RED_TEXT "missing bytes" NORMAL_TEXT);
-		return CommandResponse::MissingData;
-	}
+void Bluetooth::build_extended_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const uint8_t* payload, uint8_t size)
+{
+	size = std::min<uint8_t>(size, sizeof(ODID_MessagePack_encoded));
 
-	switch (hdr->evt) {
-	case EVT_CMD_COMPLETE: {
-		evt_cmd_complete* cc = (evt_cmd_complete*)(&buf[1 + HCI_EVENT_HDR_SIZE]);
+	hci::LeSetExtendedAdvertisingData command = {
+		.handle = handle,
+		.data_length = uint8_t(hci::OdidServiceData::SIZE + size),
+	};
+	auto header = command.serialize();
+	auto service_data = hci::OdidServiceData { .payload_size = size }.serialize();
 
-		if (cc->opcode != opcode) {
-			LOG(RED_TEXT "Wrong opcode: %u expected %u" NORMAL_TEXT, cc->opcode, opcode);
-			LOG(RED_TEXT "ogf: 0x%x expected 0x%x" NORMAL_TEXT, cmd_opcode_ogf(cc->opcode), cmd_opcode_ogf(opcode));
-			LOG(RED_TEXT "ocf: 0x%x expected 0x%x" NORMAL_TEXT, cmd_opcode_ocf(cc->opcode), cmd_opcode_ocf(opcode));
-			return CommandResponse::InvalidOpCode;
-		}
+	uint8_t* buf = frame->buf;
+	memcpy(buf, header.data(), header.length());
+	memcpy(buf + header.length(), service_data.data(), service_data.length());
+	memcpy(buf + header.length() + service_data.length(), payload, size);
 
-		// Copy param values into response data
-		ssize_t params_offset = HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE;
-		memcpy(response, &buf[params_offset], response_size);
+	frame->ocf = hci::LeSetExtendedAdvertisingData::OCF;
+	frame->length = header.length() + service_data.length() + size;
+	frame->counter_offset = header.length() + hci::OdidServiceData::COUNTER_OFFSET;
+}
 
-		switch (response[0]) {
-		case 0x00:
-			return CommandResponse::Success;
+void Bluetooth::build_periodic_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const uint8_t* payload, uint8_t size)
+{
+	size = std::min<uint8_t>(size, sizeof(ODID_MessagePack_encoded));
 
-		case 0x07:
-			LOG(RED_TEXT "Memory capacity exceed" NORMAL_TEXT);
-			break;
+	hci::LeSetPeriodicAdvertisingData command = {
+		.handle = handle,
+		.data_length = uint8_t(hci::OdidServiceData::SIZE + size),
+	};
+	auto header = command.serialize();
+	auto service_data = hci::OdidServiceData { .payload_size = size }.serialize();
 
-		case 0xC:
-			LOG(RED_TEXT "Command disallowed" NORMAL_TEXT);
-			break;
+	uint8_t* buf = frame->buf;
+	memcpy(buf, header.data(), header.length());
+	memcpy(buf + header.length(), service_data.data(), service_data.length());
+	memcpy(buf + header.length() + service_data.length(), payload, size);
 
-		case 0x12:
-			LOG(RED_TEXT "Invalid HCI command parameter" NORMAL_TEXT);
-			break;
+	frame->ocf = hci::LeSetPeriodicAdvertisingData::OCF;
+	frame->length = header.length() + service_data.length() + size;
+	frame->counter_offset = header.length() + hci::OdidServiceData::COUNTER_OFFSET;
+}
 
-		default:
-			LOG(RED_TEXT "Unhandled error status: 0x%x" NORMAL_TEXT, response[0]);
-			break;
-		}
+void Bluetooth::submit_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length, const char* description,
+			       CommandCallback on_success, uint64_t timeout_ms)
+{
+	_command_queue.submit(ogf, ocf, data, length, timeout_ms, description, std::move(on_success));
+}
 
-		break;
-	}
+void Bluetooth::wait_for_pending_commands()
+{
+	_command_queue.wait_until_idle();
+}
 
-	case EVT_CMD_STATUS: {
-		LOG("TODO: Received event command status");
-		break;
+void Bluetooth::handle_packet(const uint8_t* buf, size_t bytes_read)
+{
+	// The packet type and event header are read before anything else
+	if (bytes_read < HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE) {
+		LOG(RED_TEXT "missing bytes" NORMAL_TEXT);
+		return;
 	}
 
-	default:
-		LOG("Received unknown event: 0x%X", hdr->evt);
-		break;
+	// Check packet type
+	if (buf[0] != HCI_EVENT_PKT) {
+		LOG(RED_TEXT "wrong packet type: %u" NORMAL_TEXT, buf[0]);
+		return;
 	}
 
-	return CommandResponse::Error;
-}
+	// Points to hci event header struct
+	// | Packet Type (1 byte) | Event Code (1 byte) | Parameter Total Length (1 byte) | Event Parameters (Variable) |
+	const hci_event_hdr* hdr = (const hci_event_hdr*)(buf + HCI_TYPE_LEN);
+	size_t packet_length = hdr->plen + HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE;
 
-bool Bluetooth::send_command(uint8_t ogf, uint16_t ocf, uint8_t* data, uint8_t length)
-{
-	if (hci_send_cmd(_device, ogf, ocf, length, data) < 0) {
-		LOG(RED_TEXT "send_command failed (did you use sudo?)" NORMAL_TEXT);
-		return false;
+	if (bytes_read < packet_length) {
+		LOG(RED_TEXT "missing bytes" NORMAL_TEXT);
+		return;
 	}
 
-	return true;
+	_dispatcher.dispatch(buf, bytes_read);
 }
 
 } // end namespace bt
\ No newline at end of file
@@ -1,18 +1,56 @@
 #pragma once
 
+#include "ControllerCapabilities.hpp"
+#include "HciCommandQueue.hpp"
+#include "HciCommands.hpp"
+#include "HciEventDispatcher.hpp"
+#include "HciReactor.hpp"
+#include "HciTransport.hpp"
+
 #include <opendroneid.h>
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace bt
 {
 
+struct AdvertisingSet {
+	uint8_t handle {};
+	// Legacy advertisements use an extended advertising set with legacy PDUs since the
+	// legacy and extended HCI advertising commands cannot be mixed
+	bool legacy_pdus {};
+	uint16_t duration_10ms {}; // 0 = advertise until disabled
+	uint8_t max_events {};     // 0 = no maximum number of advertising events
+	// Also runs a periodic advertising train from the set, its extended advertisements only point to it. 0 = none.
+	uint16_t periodic_interval_ms {};
+};
+
+// Ready to send advertising data command. Only the message counter changes between sends,
+// so it is built once per encoded message and patched in place.
+struct AdvertisingDataFrame {
+	uint16_t ocf {};
+	uint8_t length {};
+	uint8_t counter_offset {};
+	uint8_t buf[hci::LeSetExtendedAdvertisingData::SIZE + hci::OdidServiceData::SIZE + sizeof(ODID_MessagePack_encoded)] {};
+};
+
+static_assert(hci::LeSetPeriodicAdvertisingData::SIZE <= hci::LeSetExtendedAdvertisingData::SIZE);
+static_assert(hci::OdidServiceData::SIZE + sizeof(ODID_MessagePack_encoded) <= hci::LeSetPeriodicAdvertisingData::MAX_DATA_LENGTH);
+
+static_assert(hci::OdidServiceData::SIZE + sizeof(ODID_MessagePack_encoded) <= hci::LeSetExtendedAdvertisingData::MAX_DATA_LENGTH);
+static_assert(hci::OdidServiceData::SIZE + ODID_MESSAGE_SIZE <= hci::LeSetAdvertisingData::MAX_DATA_LENGTH);
+
 class Bluetooth
 {
 public:
-	Bluetooth(const std::string& device_name);
+	// Advertises from the random static address mac, adapters broadcasting for the same UAS share it
+	Bluetooth(std::shared_ptr<HciTransport> transport, const std::string& mac);
 
-	bool initialize();
+	// Probes the controller, or takes its capabilities from cache_directory when it was probed before
+	bool initialize(const std::string& cache_directory = {});
 
 	void stop();
 
@@ -20,6 +58,13 @@ public:
 	void legacy_set_advertising_data(const ODID_Message_encoded* data, uint8_t count);
 	// BT LE
 	void hci_le_set_extended_advertising_data(const ODID_Message_encoded* data, uint8_t count);
+	void hci_le_set_extended_advertising_pack(const ODID_MessagePack_encoded* pack, uint8_t count);
+
+	const ControllerCapabilities& capabilities() const { return _capabilities; };
+	// Advertising data bytes the controller accepts per advertisement, 0 if it does not support extended advertising
+	uint16_t max_advertising_data_length() const { return _capabilities.max_advertising_data_length; };
+	// Bytes of the advertising data needed for a message pack, including the ODID service data header
+	static uint16_t advertising_data_length(const ODID_MessagePack_encoded* pack) { return 6 + message_pack_size(pack); };
 
 	void enable_legacy_advertising();
 	void enable_le_extended_advertising();
@@ -27,43 +72,93 @@ public:
 	void disable_legacy_advertising();
 	void disable_le_extended_advertising();
 
-private:
+	// Configures all sets and enables them together, the controller interleaves them from then on.
+	// Periodic advertising trains are started along with their sets.
+	void enable_advertising_sets(const std::vector<AdvertisingSet>& sets);
+	// Re-enables the sets, which restarts their duration and event count, and restarts their periodic trains
+	void refresh_advertising_sets(const std::vector<AdvertisingSet>& sets);
+
+	// Queues disabling the advertisement and changing its address, used to broadcast for several UAS from one
+	// set. Queue the data for the new address before resume_advertising() so it is never sent from the old one.
+	// legacy_commands selects the legacy advertising commands instead of the set.
+	void change_advertising_address(const AdvertisingSet& set, const std::string& mac, bool legacy_commands);
+	void resume_advertising(const AdvertisingSet& set, bool legacy_commands);
 
-	std::string generate_random_mac_address();
+	// Random static device address
+	static std::string generate_random_mac_address();
+
+	// Queues a data update for an enabled advertising set, flush_advertising_data() waits for all of them
+	void update_advertising_set_data(uint8_t handle, const ODID_Message_encoded* data, uint8_t count);
+	void update_advertising_set_pack(uint8_t handle, const ODID_MessagePack_encoded* pack, uint8_t count);
+	void flush_advertising_data();
+
+	static void build_legacy_advertising_data(AdvertisingDataFrame* frame, const ODID_Message_encoded* data);
+	static void build_extended_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const ODID_Message_encoded* data);
+	static void build_extended_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const ODID_MessagePack_encoded* pack);
+	// Data of the periodic advertising train of the set, sent with the next AUX_SYNC_IND
+	static void build_periodic_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const ODID_Message_encoded* data);
+	// Sets the message counter and queues the frame, flush_advertising_data() waits for it.
+	// on_complete runs on the reactor thread once the controller accepted the data.
+	void send_advertising_data(AdvertisingDataFrame* frame, uint8_t count, CommandCallback on_complete = {});
+
+	// The thread completing commands, every advertisement waits for it
+	std::thread::native_handle_type reactor_thread() { return _reactor.native_handle(); };
+
+	// Per opcode counts, latencies and error codes of every command sent so far
+	void print_command_stats() { _command_queue.stats().print(); };
+
+	static constexpr uint8_t MAX_ADVERTISING_SETS = 63;
+
+private:
 
 	void read_le_host_support();
 	void write_le_host_support();
 
-	int hci_open();
 	void hci_reset();
 
-	bool send_command(uint8_t ogf, uint16_t ocf, uint8_t* data, uint8_t length);
+	// Queues a command behind the controller's command credits. Failures are logged as "Failed to <description>",
+	// on_success is called with the return parameters once the command completed successfully.
+	void submit_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length, const char* description,
+			    CommandCallback on_success = {}, uint64_t timeout_ms = 100);
+
+	template<typename Command>
+	void submit_command(const Command& command, const char* description, CommandCallback on_success = {}, uint64_t timeout_ms = 100)
+	{
+		auto parameters = command.serialize();
+		submit_command(Command::OGF, Command::OCF, parameters.data(), parameters.length(), description, std::move(on_success),
+			       timeout_ms);
+	}
+
+	// Processes controller events until every submitted command has completed or timed out
+	void wait_for_pending_commands();
 
-	// Returns status code
-	uint8_t wait_for_command_acknowledged(uint16_t opcode, uint64_t timeout_ms, uint8_t* response_data = nullptr, uint8_t response_size = 0);
+	// Called on the reactor thread for every packet read from the controller
+	void handle_packet(const uint8_t* buf, size_t bytes_read);
 
-	// Returns bytes read
-	enum class CommandResponse {
-		Error,
-		NoData,
-		MissingData,
-		InvalidPacketType,
-		InvalidOpCode,
-		Success,
-	};
-	CommandResponse read_command_response(uint16_t opcode, uint8_t* response, int response_size);
+	void read_bd_addr();
+	void read_local_version_information();
+	// Everything beyond the address and version, which identify the controller in the cache.
+	// False if a read failed, the capabilities are then incomplete.
+	bool probe_capabilities();
 
 	// BT5
 	uint16_t le_read_maximum_advertising_data_length();
+	void le_read_number_of_supported_advertising_sets();
 
-	void le_set_extended_advertising_enable();
+	void le_set_extended_advertising_enable(const std::vector<AdvertisingSet>& sets = { AdvertisingSet{} }, bool enable = true);
 	void le_set_extended_advertising_disable();
 	void le_read_local_supported_features();
 
 	void hci_read_local_supported_features();
 
-	void le_set_extended_advertising_parameters(int interval_ms);
-	void le_set_advertising_set_random_address();
+	void le_set_extended_advertising_parameters(int interval_ms, uint8_t handle = 0, bool legacy_pdus = false);
+	// payload is a single encoded message or a message pack
+	static void build_extended_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const uint8_t* payload, uint8_t size);
+	static void build_periodic_advertising_data(AdvertisingDataFrame* frame, uint8_t handle, const uint8_t* payload, uint8_t size);
+	static uint8_t message_pack_size(const ODID_MessagePack_encoded* pack);
+	void le_set_advertising_set_random_address(uint8_t handle, const std::string& mac);
+	void le_set_periodic_advertising_parameters(uint8_t handle, uint16_t interval_ms);
+	void le_set_periodic_advertising_enable(uint8_t handle, bool enable);
 	void le_remove_advertising_set();
 
 	// BT Legacy
@@ -72,14 +167,21 @@ private:
 	// -- enable adv
 	// -- send data
 	void legacy_set_advertising_parameters(uint16_t interval_ms);
-	void legacy_set_random_address();
+	void legacy_set_random_address(const std::string& mac);
 	void legacy_set_advertising_enable();
 	void legacy_set_advertising_disable();
 
 private:
 	std::string _mac {};
-	std::string _device_name {};
-	int _device {};
+	ControllerCapabilities _capabilities {};
+	// Handles of the sets with a periodic advertising train, bit N is handle N
+	std::atomic<uint64_t> _periodic_handles {};
+	// Successful identity and capability reads, counted on the reactor thread before wait_for_pending_commands() returns
+	int _reads_completed {};
+	std::shared_ptr<HciTransport> _transport {};
+	HciCommandQueue _command_queue;
+	HciEventDispatcher _dispatcher;
+	HciReactor _reactor;
 };
 
 } // end namespace bt
\ No newline at end of file
@@ -17,123 +17,66 @@
 namespace bt
 {
 
-void Bluetooth::legacy_set_random_address()
+void Bluetooth::legacy_set_random_address(const std::string& mac)
 {
 	// LOG("Setting random address: Legacy");
 
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = OCF_LE_SET_RANDOM_ADDRESS;
-	uint8_t buf[_mac.size()] = {};
-
-	memcpy(buf, _mac.data(), _mac.size());
-
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set legacy random address: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	submit_command(hci::LeSetRandomAddress { .random_address = hci::address(mac) }, "set legacy random address");
 }
 
 void Bluetooth::legacy_set_advertising_enable()
 {
 	// LOG("Setting legacy advertising enable");
 
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = OCF_LE_SET_ADVERTISE_ENABLE;
-	uint8_t enable = 1;
-
-	if (send_command(ogf, ocf, &enable, sizeof(enable))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set legacy advertising enable: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	submit_command(hci::LeSetAdvertiseEnable { .enable = true }, "set legacy advertising enable");
 }
 
 void Bluetooth::legacy_set_advertising_disable()
 {
 	// LOG("Setting legacy advertising disable");
 
-	uint8_t ogf = OGF_LE_CTL;
-	uint16_t ocf = OCF_LE_SET_ADVERTISE_ENABLE;
-	uint8_t enable = 0;
-
-	if (send_command(ogf, ocf, &enable, sizeof(enable))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set legacy advertising disable: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	submit_command(hci::LeSetAdvertiseEnable { .enable = false }, "set legacy advertising disable");
 }
 
 void Bluetooth::legacy_set_advertising_parameters(uint16_t interval_ms)
 {
 	// LOG("Setting legacy advertising parameters");
 
-	uint8_t ogf = OGF_LE_CTL;     // Opcode Group Field. LE Controller Commands
-	uint16_t ocf = OCF_LE_SET_ADVERTISING_PARAMETERS;
-	uint8_t buf[] = { 0x00, 0x08, // Advertising_Interval_Min: N * 0.625 ms. 0x000800 = 1280 ms
-			  0x00, 0x08, // Advertising_Interval_Max: N * 0.625 ms. 0x000800 = 1280 ms
-			  0x03,       // Advertising_Type: 3 = Non connectable undirected advertising (ADV_NONCONN_IND)
-			  0x01,       // Own_Address_Type: 1 = Random Device Address
-			  0x00,       // Peer_Address_Type: 0 = Public Device Address (default) or Public Identity Address
-			  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // Peer_Address
-			  0x07,       // Advertising_Channel_Map: 7 = all three channels enabled
-			  0x00      // Advertising_Filter_Policy: 0 = Process scan and connection requests from all devices (i.e., the White List is not in use) (default).
-			};
-
-	interval_ms = std::min(std::max((1000 * interval_ms) / 625, 0x0020), 0x4000);
-	buf[0] = interval_ms & 0xFF;
-	buf[1] = (interval_ms >> 8) & 0xFF;
-	buf[2] = interval_ms & 0xFF;
-	buf[3] = (interval_ms >> 8) & 0xFF;
+	uint16_t interval = hci::interval_units(interval_ms, hci::LeSetAdvertisingParameters::MAX_INTERVAL);
+	hci::LeSetAdvertisingParameters command = {
+		.interval_min = interval,
+		.interval_max = interval,
+	};
 
 	// Send off the data
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set legacy advertising parameters: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	submit_command(command, "set legacy advertising parameters");
 }
 
 void Bluetooth::legacy_set_advertising_data(const ODID_Message_encoded* data, uint8_t count)
 {
 	// LOG("Setting legacy advertising data");
 
-	uint8_t ogf = OGF_LE_CTL; // Opcode Group Field. LE Controller Commands
-	uint16_t ocf = OCF_LE_SET_ADVERTISING_DATA; // LE Set Advertising Data
-	uint8_t buf[7 + ODID_MESSAGE_SIZE] = {
-		0x1F, // Advertising_Data_Length: The number of significant octets in the Advertising_Data.
-		0x1E, // Length of the service data element
-		0x16, // 16 = GAP AD Type = "Service Data - 16-bit UUID"
-		0xFA, 0xFF, // 0xFFFA = ASTM International, ASTM Remote ID
-		0x0D, // 0x0D = AD Application Code within the ASTM address space = Open Drone ID
-		0x00, // xx = 8-bit message counter starting at 0x00 and wrapping around at 0xFF
-		0x00
-	};
-	buf[6] = count;
-
-	memcpy(&buf[7], (uint8_t*)data, ODID_MESSAGE_SIZE);
+	AdvertisingDataFrame frame;
+	build_legacy_advertising_data(&frame, data);
 
 	// Send off the data
-	if (send_command(ogf, ocf, buf, sizeof(buf))) {
-		uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
-		uint8_t status = wait_for_command_acknowledged(opcode, 100);
-
-		if (status) {
-			LOG(RED_TEXT "Failed to set legacy advertising data: error 0x%x" NORMAL_TEXT, status);
-		}
-	}
+	send_advertising_data(&frame, count);
+	wait_for_pending_commands();
+}
+
+void Bluetooth::build_legacy_advertising_data(AdvertisingDataFrame* frame, const ODID_Message_encoded* data)
+{
+	// Advertising_Data_Length: the whole 31 octets are significant
+	auto header = hci::LeSetAdvertisingData { .data_length = hci::LeSetAdvertisingData::MAX_DATA_LENGTH }.serialize();
+	auto service_data = hci::OdidServiceData { .payload_size = ODID_MESSAGE_SIZE }.serialize();
+
+	memcpy(frame->buf, header.data(), header.length());
+	memcpy(&frame->buf[header.length()], service_data.data(), service_data.length());
+	memcpy(&frame->buf[header.length() + service_data.length()], (uint8_t*)data, ODID_MESSAGE_SIZE);
+
+	frame->ocf = hci::LeSetAdvertisingData::OCF;
+	frame->length = header.length() + service_data.length() + ODID_MESSAGE_SIZE;
+	frame->counter_offset = header.length() + hci::OdidServiceData::COUNTER_OFFSET;
 }
 
 } // end namepspace bt
\ No newline at end of file
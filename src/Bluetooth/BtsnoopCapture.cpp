@@ -0,0 +1,351 @@
+#include "BtsnoopCapture.hpp"
+
+#include <global_include.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+namespace bt
+{
+
+static constexpr uint32_t BTSNOOP_SENT_COMMAND = 0x02;
+static constexpr uint32_t BTSNOOP_RECEIVED_EVENT = 0x03;
+
+// Microseconds from 0 AD to the Unix epoch
+static constexpr int64_t BTSNOOP_UNIX_EPOCH_US = 0x00dcddb30f2f8000;
+
+// Smallest file the capture rolls over in
+static constexpr size_t MIN_FILE_SIZE = 64 * 1024;
+
+// Cuts a capture of an earlier run after its last complete record and moves it out of the way
+static void keep_previous(const std::string& path, const std::string& kept_path)
+{
+	int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st = {};
+	fstat(fd, &st);
+	size_t size = st.st_size;
+	size_t end = 0;
+
+	if (size >= sizeof(BtsnoopHeader)) {
+		void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (data != MAP_FAILED) {
+			end = sizeof(BtsnoopHeader);
+
+			// Unused space is zeroed, a record without data ends the capture
+			while (end + sizeof(BtsnoopRecord) <= size) {
+				BtsnoopRecord record;
+				memcpy(&record, (const uint8_t*)data + end, sizeof(record));
+				size_t length = be32toh(record.included_length);
+
+				if (length == 0 || end + sizeof(record) + length > size) {
+					break;
+				}
+
+				end += sizeof(record) + length;
+			}
+
+			munmap(data, size);
+		}
+	}
+
+	if (ftruncate(fd, end) < 0 || rename(path.c_str(), kept_path.c_str()) < 0) {
+		LOG(RED_TEXT "Failed to keep the previous HCI capture %s: %s" NORMAL_TEXT, path.c_str(), strerror(errno));
+	}
+
+	::close(fd);
+}
+
+BtsnoopCapture::BtsnoopCapture(std::shared_ptr<HciTransport> transport, const std::string& path, size_t max_size)
+	: _transport(transport)
+	, _path(path)
+	, _rotated_path(path + ".1")
+	, _spare_path(path + ".next")
+	, _file_size(std::max(max_size / 3, MIN_FILE_SIZE))
+{}
+
+BtsnoopCapture::~BtsnoopCapture()
+{
+	close();
+}
+
+bool BtsnoopCapture::open()
+{
+	if (!_transport->open()) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (open_capture()) {
+		LOG("Capturing HCI traffic to %s, %zu KiB per file", _path.c_str(), _file_size / 1024);
+
+	} else {
+		LOG(RED_TEXT "Failed to open HCI capture %s: %s" NORMAL_TEXT, _path.c_str(), strerror(errno));
+		close_capture();
+	}
+
+	return true;
+}
+
+void BtsnoopCapture::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_should_exit = true;
+	}
+
+	_wake_cv.notify_all();
+
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		close_capture();
+	}
+
+	_transport->close();
+}
+
+bool BtsnoopCapture::send_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length)
+{
+	// Recorded before sending, the response must not come before its command in the capture
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if (uint8_t* packet = reserve(BTSNOOP_SENT_COMMAND, 1 + HCI_COMMAND_HDR_SIZE + length)) {
+			uint16_t opcode = cmd_opcode_pack(ogf, ocf);
+			packet[0] = HCI_COMMAND_PKT;
+			packet[1] = opcode & 0xff;
+			packet[2] = opcode >> 8;
+			packet[3] = length;
+			memcpy(packet + 1 + HCI_COMMAND_HDR_SIZE, data, length);
+		}
+	}
+
+	return _transport->send_command(ogf, ocf, data, length);
+}
+
+ssize_t BtsnoopCapture::read(uint8_t* buf, size_t size)
+{
+	ssize_t bytes_read = _transport->read(buf, size);
+
+	if (bytes_read > 0) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if (uint8_t* packet = reserve(BTSNOOP_RECEIVED_EVENT, bytes_read)) {
+			memcpy(packet, buf, bytes_read);
+		}
+	}
+
+	return bytes_read;
+}
+
+bool BtsnoopCapture::open_capture()
+{
+	_used = sizeof(BtsnoopHeader);
+	_packets = 0;
+	_dropped = 0;
+	_finished = -1;
+	_should_exit = false;
+
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(_path).parent_path(), error);
+
+	keep_previous(_path, _path + ".prev");
+	keep_previous(_rotated_path, _rotated_path + ".prev");
+
+	const std::string* paths[3] = { &_path, &_rotated_path, &_spare_path };
+
+	for (int i = 0; i < 3; i++) {
+		File& file = _files[i];
+		file.fd = ::open(paths[i]->c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (file.fd < 0 || !prepare(file)) {
+			return false;
+		}
+	}
+
+	_current = 0;
+	_previous = 1;
+	_spare = 2;
+	_spare_ready = true;
+
+	// <path>.1 stays an empty capture until the first rollover
+	if (ftruncate(_files[_previous].fd, sizeof(BtsnoopHeader)) < 0) {
+		return false;
+	}
+
+	_thread = std::thread(&BtsnoopCapture::run, this);
+	return true;
+}
+
+void BtsnoopCapture::close_capture()
+{
+	File& current = _files[_current];
+
+	if (current.data) {
+		// Ends the file after its last record, Wireshark would read the unused space as empty packets
+		if (ftruncate(current.fd, _used) < 0) {
+			LOG(RED_TEXT "Failed to trim HCI capture %s" NORMAL_TEXT, _path.c_str());
+		}
+
+		// The spare holds no packets
+		unlink(_spare_path.c_str());
+
+		LOG("Captured %" PRIu64 " HCI packets to %s, %u dropped", _packets, _path.c_str(), _dropped);
+	}
+
+	for (File& file : _files) {
+		if (file.data) {
+			munmap(file.data, _file_size);
+			file.data = nullptr;
+		}
+
+		if (file.fd >= 0) {
+			::close(file.fd);
+			file.fd = -1;
+		}
+	}
+}
+
+uint8_t* BtsnoopCapture::reserve(uint32_t flags, size_t length)
+{
+	if (!_files[_current].data) {
+		return nullptr;
+	}
+
+	if (_used + sizeof(BtsnoopRecord) + length > _file_size) {
+		// The capture thread is still preparing the spare
+		if (!_spare_ready) {
+			_dropped++;
+			return nullptr;
+		}
+
+		_finished = _current;
+		_finished_used = _used;
+		_current = _spare;
+		_spare_ready = false;
+		_used = sizeof(BtsnoopHeader);
+	}
+
+	int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	BtsnoopRecord record = {};
+	record.original_length = htobe32(length);
+	record.included_length = htobe32(length);
+	record.flags = htobe32(flags);
+	record.cumulative_drops = htobe32(_dropped);
+	record.timestamp_us = htobe64(now + BTSNOOP_UNIX_EPOCH_US);
+
+	uint8_t* position = _files[_current].data + _used;
+	memcpy(position, &record, sizeof(record));
+	_used += sizeof(record) + length;
+	_packets++;
+
+	return position + sizeof(record);
+}
+
+void BtsnoopCapture::run()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	while (true) {
+		if (_finished < 0) {
+			if (_should_exit) {
+				break;
+			}
+
+			// Polled, so a rollover never waits for a syscall to wake this thread
+			_wake_cv.wait_for(lock, std::chrono::milliseconds(20));
+			continue;
+		}
+
+		int finished = _finished;
+		size_t used = _finished_used;
+		int spare = _previous;
+		lock.unlock();
+
+		bool ready = rename_finished(finished, used) && prepare(_files[spare]);
+
+		if (!ready) {
+			LOG(RED_TEXT "Preparing the next HCI capture file failed, packets are dropped: %s" NORMAL_TEXT, strerror(errno));
+		}
+
+		lock.lock();
+		_previous = finished;
+		_spare = spare;
+		_spare_ready = ready;
+		_finished = -1;
+	}
+}
+
+bool BtsnoopCapture::rename_finished(int finished, size_t used)
+{
+	if (ftruncate(_files[finished].fd, used) < 0) {
+		return false;
+	}
+
+	// The writers moved on to <path>.next. The finished file becomes <path>.1, the new one <path>,
+	// and the file before the finished one is left as <path>.next to be prepared as the spare.
+	return renameat2(AT_FDCWD, _path.c_str(), AT_FDCWD, _spare_path.c_str(), RENAME_EXCHANGE) == 0 &&
+	       renameat2(AT_FDCWD, _spare_path.c_str(), AT_FDCWD, _rotated_path.c_str(), RENAME_EXCHANGE) == 0;
+}
+
+bool BtsnoopCapture::prepare(File& file)
+{
+	if (file.data) {
+		munmap(file.data, _file_size);
+		file.data = nullptr;
+	}
+
+	if (ftruncate(file.fd, 0) < 0) {
+		return false;
+	}
+
+	// Allocated up front, writing to the mapping of a file without disk space behind it raises SIGBUS
+	int error = posix_fallocate(file.fd, 0, _file_size);
+
+	if (error) {
+		errno = error;
+		return false;
+	}
+
+	// The pages are faulted in here instead of on the first packets written to the file
+	void* data = mmap(nullptr, _file_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, file.fd, 0);
+
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	file.data = (uint8_t*)data;
+
+	BtsnoopHeader header = {};
+	memcpy(header.magic, BTSNOOP_MAGIC, sizeof(header.magic));
+	header.version = htobe32(BTSNOOP_VERSION);
+	header.datalink = htobe32(BTSNOOP_DATALINK_H4);
+	memcpy(file.data, &header, sizeof(header));
+	return true;
+}
+
+} // end namespace bt
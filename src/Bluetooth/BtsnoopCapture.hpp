@@ -0,0 +1,102 @@
+#pragma once
+
+#include "HciTransport.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace bt
+{
+
+// btsnoop file header, all fields big endian. Datalink 1002 is HCI UART (H4): every packet starts with
+// its packet type byte, as the transport already delivers events.
+static constexpr char BTSNOOP_MAGIC[8] = { 'b', 't', 's', 'n', 'o', 'o', 'p', '\0' };
+static constexpr uint32_t BTSNOOP_VERSION = 1;
+static constexpr uint32_t BTSNOOP_DATALINK_H4 = 1002;
+
+struct BtsnoopHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t datalink;
+};
+
+struct BtsnoopRecord {
+	uint32_t original_length;
+	uint32_t included_length;
+	uint32_t flags; // Bit 0: received by the host, bit 1: command or event
+	uint32_t cumulative_drops;
+	int64_t timestamp_us; // Microseconds since 0 AD
+};
+
+static_assert(sizeof(BtsnoopHeader) == 16 && sizeof(BtsnoopRecord) == 24, "btsnoop layout");
+
+// Records every HCI command and event of a transport in btsnoop format, for Wireshark. The capture rolls
+// over between preallocated, memory-mapped files of max_size / 3: <path> is written, <path>.1 holds the
+// part before it and <path>.next is the empty spare. Recording a packet is a copy into the mapping, a
+// rollover only switches to the spare. The capture thread renames the files and prepares the next spare,
+// packets that arrive before it is ready are dropped and counted in the records.
+// A crash leaves zeroed space behind the last packet, the next start trims it and keeps the files as
+// <path>.prev and <path>.1.prev.
+class BtsnoopCapture : public HciTransport
+{
+public:
+	BtsnoopCapture(std::shared_ptr<HciTransport> transport, const std::string& path, size_t max_size);
+	~BtsnoopCapture() override;
+
+	// Opens the wrapped transport, a capture that fails to open is logged and skipped
+	bool open() override;
+	void close() override;
+
+	int fd() const override { return _transport->fd(); };
+
+	bool send_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length) override;
+	ssize_t read(uint8_t* buf, size_t size) override;
+
+private:
+	struct File {
+		int fd {-1};
+		uint8_t* data {};
+	};
+
+	bool open_capture();
+	void close_capture();
+
+	// Returns space for a record with length bytes of packet data, nullptr if it is dropped
+	uint8_t* reserve(uint32_t flags, size_t length);
+
+	// Capture thread: renames the file the writers rolled over from and prepares the next spare
+	void run();
+	bool rename_finished(int finished, size_t used);
+
+	// Empties the file, allocates its full size again, maps it and writes the header
+	bool prepare(File& file);
+
+	std::shared_ptr<HciTransport> _transport {};
+	std::string _path {};
+	std::string _rotated_path {};
+	std::string _spare_path {};
+	size_t _file_size {};
+
+	std::mutex _mutex;
+	std::condition_variable _wake_cv;
+	std::thread _thread;
+	bool _should_exit {};
+
+	File _files[3] {};
+	int _current {};
+	int _previous {};
+	int _spare {};
+	bool _spare_ready {};
+	// File the writers rolled over from and its length, -1 once the capture thread renamed it
+	int _finished {-1};
+	size_t _finished_used {};
+
+	size_t _used {};
+	uint64_t _packets {};
+	uint32_t _dropped {};
+};
+
+} // end namespace bt
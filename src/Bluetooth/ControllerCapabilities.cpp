@@ -0,0 +1,135 @@
+#include "ControllerCapabilities.hpp"
+#include "print_bt_features.h"
+
+#include <global_include.hpp>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace bt
+{
+
+std::string ControllerCapabilities::key() const
+{
+	if (address.empty()) {
+		return {};
+	}
+
+	std::string name = address;
+	name.erase(std::remove(name.begin(), name.end(), ':'), name.end());
+
+	char version[64];
+	snprintf(version, sizeof(version), "-%02x-%04x-%04x-%04x", hci_version, hci_revision, manufacturer, lmp_subversion);
+	return name + version;
+}
+
+bool ControllerCapabilities::load(const std::string& directory)
+{
+	if (directory.empty() || key().empty()) {
+		return false;
+	}
+
+	std::string path = directory + "/" + key();
+	FILE* file = fopen(path.c_str(), "r");
+
+	if (!file) {
+		return false;
+	}
+
+	// One "name = value" line per probed field, the file name already matched the controller
+	char name[64];
+	uint64_t value = 0;
+	int fields = 0;
+
+	while (fscanf(file, "%63s = %" SCNx64, name, &value) == 2) {
+		if (!strcmp(name, "hci_features")) {
+			hci_features = value;
+
+		} else if (!strcmp(name, "le_features")) {
+			le_features = value;
+
+		} else if (!strcmp(name, "max_advertising_data_length")) {
+			max_advertising_data_length = value;
+
+		} else if (!strcmp(name, "num_advertising_sets")) {
+			num_advertising_sets = value;
+
+		} else {
+			continue;
+		}
+
+		fields++;
+	}
+
+	fclose(file);
+
+	if (fields != 4) {
+		LOG(RED_TEXT "Ignoring incomplete controller cache %s" NORMAL_TEXT, path.c_str());
+		return false;
+	}
+
+	LOG("Controller capabilities from %s", path.c_str());
+	return true;
+}
+
+bool ControllerCapabilities::save(const std::string& directory) const
+{
+	if (directory.empty() || key().empty()) {
+		return false;
+	}
+
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+
+	// Written next to the cache and renamed, a crash never leaves a partial file behind
+	std::string path = directory + "/" + key();
+	std::string temporary = path + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "w");
+
+	if (!file) {
+		LOG(RED_TEXT "Failed to write controller cache %s: %s" NORMAL_TEXT, temporary.c_str(), strerror(errno));
+		return false;
+	}
+
+	fprintf(file, "hci_features = %" PRIx64 "\n", hci_features);
+	fprintf(file, "le_features = %" PRIx64 "\n", le_features);
+	fprintf(file, "max_advertising_data_length = %x\n", max_advertising_data_length);
+	fprintf(file, "num_advertising_sets = %x\n", num_advertising_sets);
+
+	bool written = fclose(file) == 0;
+
+	if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+		LOG(RED_TEXT "Failed to write controller cache %s" NORMAL_TEXT, path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+void ControllerCapabilities::print() const
+{
+	LOG("Controller %s: HCI version %u revision 0x%04x, manufacturer 0x%04x, LMP subversion 0x%04x", address.c_str(),
+	    hci_version, hci_revision, manufacturer, lmp_subversion);
+
+	// The feature lists are printed through stdio. The log is flushed before and stdout after each list,
+	// so every list follows its header.
+	uint8_t features[8];
+	memcpy(features, &le_features, sizeof(features));
+	LOG("Supported LE Bluetooth features:");
+	AsyncLog::instance().flush();
+	print_bt_le_features(features, sizeof(features));
+	fflush(stdout);
+
+	memcpy(features, &hci_features, sizeof(features));
+	LOG("Supported HCI Bluetooth features:");
+	AsyncLog::instance().flush();
+	print_bt_hci_features(features, sizeof(features));
+	fflush(stdout);
+
+	LOG("Maximum advertising data length: %u, advertising sets: %u", max_advertising_data_length, num_advertising_sets);
+}
+
+} // end namespace bt
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace bt
+{
+
+// What the controller reported at startup, read once and then taken from the cache on disk
+struct ControllerCapabilities {
+	// Read BD_ADDR, e.g. "00:1A:7D:DA:71:13"
+	std::string address {};
+
+	// Read Local Version Information
+	uint8_t hci_version {};
+	uint16_t hci_revision {};
+	uint16_t manufacturer {};
+	uint16_t lmp_subversion {};
+
+	// Read Local Supported Features and LE Read Local Supported Features, bit N is feature bit N
+	uint64_t hci_features {};
+	uint64_t le_features {};
+
+	// Extended advertising only, 0 without it
+	uint16_t max_advertising_data_length {};
+	uint8_t num_advertising_sets {};
+
+	bool le_supported() const { return hci_features & (1ull << 38); };
+	bool le_2m_phy() const { return le_features & (1ull << 8); };
+	bool le_coded_phy() const { return le_features & (1ull << 11); };
+	bool extended_advertising() const { return le_features & (1ull << 12); };
+	bool periodic_advertising() const { return le_features & (1ull << 13); };
+
+	// Identifies the controller and its firmware, empty until the address was read
+	std::string key() const;
+
+	// Reads the probed fields from <directory>/<key>, false if this controller was not cached yet
+	bool load(const std::string& directory);
+	bool save(const std::string& directory) const;
+
+	void print() const;
+};
+
+} // end namespace bt
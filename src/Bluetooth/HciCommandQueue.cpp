@@ -0,0 +1,297 @@
+#include "HciCommandQueue.hpp"
+
+#include <global_include.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+namespace bt
+{
+
+static constexpr uint16_t HCI_RESET_OPCODE = cmd_opcode_pack(OGF_HOST_CTL, 0x0003);
+
+HciCommandQueue::HciCommandQueue(std::shared_ptr<HciTransport> transport)
+	: _transport(transport)
+{}
+
+void HciCommandQueue::submit(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length, uint64_t timeout_ms,
+			     const char* description, CommandCallback on_success)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	Command command = {};
+	command.ogf = ogf;
+	command.ocf = ocf;
+	command.opcode = cmd_opcode_pack(ogf, ocf);
+	command.description = description;
+
+	if (_failed || _queued.size() + _in_flight.size() == CAPACITY) {
+		if (!_failed) {
+			LOG(RED_TEXT "%zu HCI commands pending, dropping the next one" NORMAL_TEXT, CAPACITY);
+		}
+
+		_stats.record_send_failure(command.opcode);
+		CommandResult result = {};
+		result.status = 0xFF;
+		report_failure(command, result);
+		return;
+	}
+
+	command.length = length;
+	command.timeout_ms = timeout_ms;
+	command.submitted = Clock::now();
+	command.deadline = command.submitted + std::chrono::milliseconds(timeout_ms);
+	command.on_success = std::move(on_success);
+
+	if (length) {
+		memcpy(command.data.data(), data, length);
+	}
+
+	_queued.push_back(std::move(command));
+	send_queued();
+	update_deadline();
+}
+
+void HciCommandQueue::send_queued()
+{
+	while (!_queued.empty() && _credits > 0 && !_barrier) {
+		Command& command = _queued.front();
+
+		if (!_transport->send_command(command.ogf, command.ocf, command.data.data(), command.length)) {
+			LOG(RED_TEXT "send_command failed (did you use sudo?)" NORMAL_TEXT);
+			_stats.record_send_failure(command.opcode);
+			CommandResult result = {};
+			result.status = 0xFF;
+			report_failure(command, result);
+			_queued.pop_front();
+			continue;
+		}
+
+		_credits--;
+		_barrier = command.opcode == HCI_RESET_OPCODE;
+		command.sent = Clock::now();
+		command.deadline = command.sent + std::chrono::milliseconds(command.timeout_ms);
+		// Space is reserved in submit(), queued and in flight together never exceed the capacity
+		_in_flight.push_back(std::move(command));
+		_queued.pop_front();
+	}
+
+	// Waiters see the queue drained by send failures
+	if (idle()) {
+		_idle_cv.notify_all();
+	}
+}
+
+void HciCommandQueue::report_failure(const Command& command, const CommandResult& result)
+{
+	if (result.timed_out) {
+		LOG(RED_TEXT "Failed to %s: timed out" NORMAL_TEXT, command.description);
+		return;
+	}
+
+	switch (result.status) {
+	case 0x07:
+		LOG(RED_TEXT "Memory capacity exceed" NORMAL_TEXT);
+		break;
+
+	case 0xC:
+		LOG(RED_TEXT "Command disallowed" NORMAL_TEXT);
+		break;
+
+	case 0x12:
+		LOG(RED_TEXT "Invalid HCI command parameter" NORMAL_TEXT);
+		break;
+
+	case 0xFF:
+		// Not sent, or the transport failed before the controller answered
+		break;
+
+	default:
+		LOG(RED_TEXT "Unhandled error status: 0x%x" NORMAL_TEXT, result.status);
+		break;
+	}
+
+	LOG(RED_TEXT "Failed to %s: error 0x%x" NORMAL_TEXT, command.description, result.status);
+}
+
+bool HciCommandQueue::complete(uint16_t opcode, uint8_t ncmd, const CommandResult& result)
+{
+	CommandCallback on_success;
+	bool matched = false;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		size_t index = 0;
+
+		while (index < _in_flight.size() && _in_flight[index].opcode != opcode) {
+			index++;
+		}
+
+		if (opcode == 0x0000) {
+			// Opcode 0x0000 only hands out credits
+			_credits = ncmd;
+
+		} else if (index == _in_flight.size()) {
+			// Unsolicited completion. Its credit count may predate commands that are still
+			// on their way to the controller so it is never allowed to raise our credits.
+			_credits = std::min(_credits, ncmd);
+
+		} else {
+			Command& command = _in_flight[index];
+			_credits = ncmd;
+
+			if (opcode == HCI_RESET_OPCODE) {
+				_barrier = false;
+			}
+
+			_stats.record_completed(opcode, result.status, command.sent - command.submitted, Clock::now() - command.sent);
+
+			if (result.status == 0x00 && command.on_success) {
+				on_success = std::move(command.on_success);
+				_completing++;
+
+			} else if (result.status != 0x00) {
+				report_failure(command, result);
+			}
+
+			_in_flight.erase(index);
+			matched = true;
+		}
+
+		send_queued();
+		update_deadline();
+	}
+
+	if (on_success) {
+		on_success(result);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_completing--;
+	}
+
+	if (matched) {
+		_idle_cv.notify_all();
+	}
+
+	return matched;
+}
+
+void HciCommandQueue::expire_timed_out()
+{
+	bool stalled = false;
+	bool expired = false;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto now = Clock::now();
+
+		// A completion can hand out zero credits. With nothing in flight no later completion returns
+		// one, so the queue would wait forever: assume the controller takes one command again.
+		if (_in_flight.empty() && !_queued.empty() && _credits == 0 && now >= _queued.front().deadline) {
+			stalled = true;
+			_credits = 1;
+			send_queued();
+		}
+
+		CommandResult result = {};
+		result.timed_out = true;
+
+		for (size_t index = 0; index < _in_flight.size();) {
+			Command& command = _in_flight[index];
+
+			if (now < command.deadline) {
+				index++;
+				continue;
+			}
+
+			if (command.opcode == HCI_RESET_OPCODE) {
+				_barrier = false;
+			}
+
+			LOG(RED_TEXT "Timed out waiting for response: ogf 0x%x ocf 0x%x" NORMAL_TEXT, command.ogf, command.ocf);
+			_stats.record_timeout(command.opcode, command.sent - command.submitted);
+			report_failure(command, result);
+			_in_flight.erase(index);
+			expired = true;
+		}
+
+		if (expired) {
+			// Assume the controller dropped the commands and their credits with them
+			_credits = std::max<uint8_t>(_credits, 1);
+			send_queued();
+		}
+
+		// The timer is one-shot, it is armed again even if it fired early
+		update_deadline();
+	}
+
+	if (stalled) {
+		LOG(RED_TEXT "Controller returned no command credits, sending the next command anyway" NORMAL_TEXT);
+	}
+
+	if (expired) {
+		_idle_cv.notify_all();
+	}
+}
+
+void HciCommandQueue::fail_all()
+{
+	size_t failed = 0;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_failed = true;
+
+		CommandResult result = {};
+		result.status = 0xFF;
+
+		for (auto* commands : { &_in_flight, &_queued }) {
+			for (size_t index = 0; index < commands->size(); index++) {
+				_stats.record_send_failure((*commands)[index].opcode);
+				report_failure((*commands)[index], result);
+			}
+
+			failed += commands->size();
+			commands->clear();
+		}
+
+		update_deadline();
+	}
+
+	if (failed) {
+		LOG(RED_TEXT "HCI transport failed, %zu commands not completed" NORMAL_TEXT, failed);
+	}
+
+	_idle_cv.notify_all();
+}
+
+void HciCommandQueue::update_deadline()
+{
+	auto deadline = Clock::time_point::max();
+
+	for (size_t index = 0; index < _in_flight.size(); index++) {
+		deadline = std::min(deadline, _in_flight[index].deadline);
+	}
+
+	// Queued commands only time out while they wait for a credit nothing in flight will return
+	if (_in_flight.empty() && !_queued.empty() && _credits == 0) {
+		deadline = std::min(deadline, _queued.front().deadline);
+	}
+
+	if (_on_deadline_changed) _on_deadline_changed(deadline);
+}
+
+void HciCommandQueue::wait_until_idle()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_idle_cv.wait(lock, [this] { return idle(); });
+}
+
+uint8_t HciCommandQueue::credits()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _credits;
+}
+
+} // end namespace bt
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "HciCommandStats.hpp"
+#include "HciTransport.hpp"
+
+#include <fixed_ring.hpp>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace bt
+{
+
+struct CommandResult {
+	bool timed_out {};
+	uint8_t status {};        // HCI error code, 0x00 = success
+	const uint8_t* params {}; // Return parameters following the status
+	uint8_t length {};
+};
+
+// Runs once the command succeeded. Keep captures within two pointers, std::function then stores them without allocating.
+using CommandCallback = std::function<void(const CommandResult& result)>;
+
+// Keeps as many commands in flight as the controller has Num_HCI_Command_Packets credits for
+// and matches each Command Complete/Status to the oldest outstanding command with that opcode.
+// Commands are submitted from the caller's thread, events and timeouts arrive on the reactor thread.
+// Queued and in-flight commands live in fixed rings, submitting and completing never allocates.
+// Callbacks run on whichever thread completes the command, without the queue lock held. Failures
+// are logged with the command's description instead.
+class HciCommandQueue
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Commands queued and in flight together, more fail at once
+	static constexpr size_t CAPACITY = 128;
+
+	HciCommandQueue(std::shared_ptr<HciTransport> transport);
+
+	// description names the command in failure logs and must outlive it, e.g. a string literal
+	void submit(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length, uint64_t timeout_ms, const char* description,
+		    CommandCallback on_success);
+
+	// Hands a Command Complete/Status to the oldest outstanding command with this opcode.
+	// Returns false if no submitted command was waiting for it.
+	bool complete(uint16_t opcode, uint8_t ncmd, const CommandResult& result);
+
+	// Fails commands whose controller response is overdue. Queued commands that waited past their
+	// timeout for a credit while nothing was in flight get one, the controller handed out zero.
+	void expire_timed_out();
+
+	// Called with the earliest deadline of the commands in flight, or of the oldest queued command while
+	// it waits for a credit with nothing in flight, time_point::max() if there is none, whenever it may
+	// have changed. Runs with the queue lock held, so the newest deadline always wins no matter which
+	// thread submitted or completed the command. Set it before submitting anything.
+	using DeadlineHandler = std::function<void(Clock::time_point deadline)>;
+	void on_deadline_changed(DeadlineHandler handler) { _on_deadline_changed = std::move(handler); };
+
+	// The transport is gone: fails the queued and in-flight commands, and every later submit at once
+	void fail_all();
+
+	// Blocks until every submitted command has completed or timed out and its callback returned
+	void wait_until_idle();
+
+	uint8_t credits();
+
+	HciCommandStats& stats() { return _stats; };
+
+private:
+	struct Command {
+		uint8_t ogf {};
+		uint16_t ocf {};
+		uint16_t opcode {};
+		uint8_t length {};
+		std::array<uint8_t, UINT8_MAX> data {};
+		uint64_t timeout_ms {};
+		Clock::time_point submitted {};
+		Clock::time_point sent {};
+		Clock::time_point deadline {}; // Timeout from submitted while queued, from sent once in flight
+		const char* description {};
+		CommandCallback on_success {};
+	};
+
+	// All three require _mutex to be held
+	void send_queued();
+	void update_deadline();
+	bool idle() const { return _queued.empty() && _in_flight.empty() && _completing == 0; };
+
+	// Logs why the command failed, its callback is not run
+	static void report_failure(const Command& command, const CommandResult& result);
+
+	std::shared_ptr<HciTransport> _transport {};
+	DeadlineHandler _on_deadline_changed {};
+
+	std::mutex _mutex;
+	std::condition_variable _idle_cv;
+
+	FixedRing<Command, CAPACITY> _queued;
+	FixedRing<Command, CAPACITY> _in_flight;
+	// Commands removed from the queue whose callbacks have not returned yet
+	int _completing {};
+
+	// The host may send one command until the controller tells us otherwise
+	uint8_t _credits {1};
+	// HCI_Reset must complete before anything else is sent
+	bool _barrier {};
+	// Set by fail_all(), nothing is sent anymore
+	bool _failed {};
+
+	HciCommandStats _stats;
+};
+
+} // end namespace bt
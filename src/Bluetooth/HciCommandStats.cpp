@@ -0,0 +1,117 @@
+#include "HciCommandStats.hpp"
+
+#include <global_include.hpp>
+
+#include <string>
+
+namespace bt
+{
+
+struct KnownOpcode {
+	uint16_t opcode;
+	const char* name;
+};
+
+// Every command this program sends, slot order of HciCommandStats::_opcodes
+static constexpr KnownOpcode known_opcodes[] = {
+	{ 0x0C01, "Set Event Mask" },
+	{ 0x0C03, "HCI Reset" },
+	{ 0x0C6C, "Read LE Host Support" },
+	{ 0x0C6D, "Write LE Host Support" },
+	{ 0x1001, "Read Local Version Information" },
+	{ 0x1003, "Read Local Supported Features" },
+	{ 0x1009, "Read BD_ADDR" },
+	{ 0x2001, "LE Set Event Mask" },
+	{ 0x2003, "LE Read Local Supported Features" },
+	{ 0x2005, "LE Set Random Address" },
+	{ 0x2006, "LE Set Advertising Parameters" },
+	{ 0x2008, "LE Set Advertising Data" },
+	{ 0x200A, "LE Set Advertising Enable" },
+	{ 0x2035, "LE Set Advertising Set Random Address" },
+	{ 0x2036, "LE Set Extended Advertising Parameters" },
+	{ 0x2037, "LE Set Extended Advertising Data" },
+	{ 0x2039, "LE Set Extended Advertising Enable" },
+	{ 0x203A, "LE Read Maximum Advertising Data Length" },
+	{ 0x203B, "LE Read Number of Supported Advertising Sets" },
+	{ 0x203C, "LE Remove Advertising Set" },
+	{ 0x203E, "LE Set Periodic Advertising Parameters" },
+	{ 0x203F, "LE Set Periodic Advertising Data" },
+	{ 0x2040, "LE Set Periodic Advertising Enable" },
+};
+
+size_t HciCommandStats::slot(uint16_t opcode)
+{
+	static_assert(sizeof(known_opcodes) / sizeof(known_opcodes[0]) == KNOWN_OPCODES, "KNOWN_OPCODES must match the opcode table");
+
+	for (size_t i = 0; i < KNOWN_OPCODES; i++) {
+		if (known_opcodes[i].opcode == opcode) {
+			return i;
+		}
+	}
+
+	return OTHER_OPCODES;
+}
+
+void HciCommandStats::record_completed(uint16_t opcode, uint8_t status, Duration queued, Duration latency)
+{
+	auto& stats = _opcodes[slot(opcode)];
+	stats.completed.fetch_add(1, std::memory_order_relaxed);
+	stats.queued.record(queued);
+	stats.latency.record(latency);
+
+	if (status) {
+		stats.errors[status].fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void HciCommandStats::record_timeout(uint16_t opcode, Duration queued)
+{
+	auto& stats = _opcodes[slot(opcode)];
+	stats.timeouts.fetch_add(1, std::memory_order_relaxed);
+	stats.queued.record(queued);
+}
+
+void HciCommandStats::record_send_failure(uint16_t opcode)
+{
+	_opcodes[slot(opcode)].send_failures.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HciCommandStats::print()
+{
+	for (size_t i = 0; i <= KNOWN_OPCODES; i++) {
+		auto& stats = _opcodes[i];
+		uint64_t completed = stats.completed.load(std::memory_order_relaxed);
+		uint64_t timeouts = stats.timeouts.load(std::memory_order_relaxed);
+		uint64_t send_failures = stats.send_failures.load(std::memory_order_relaxed);
+
+		if (!completed && !timeouts && !send_failures) {
+			continue;
+		}
+
+		std::string errors;
+
+		for (int status = 1; status < 256; status++) {
+			uint64_t count = stats.errors[status].load(std::memory_order_relaxed);
+
+			if (count) {
+				char error[32];
+				snprintf(error, sizeof(error), " 0x%02x x%lu", status, count);
+				errors += error;
+			}
+		}
+
+		if (i == OTHER_OPCODES) {
+			LOG("HCI other commands: %lu completed, %lu timed out, %lu send failures, errors:%s",
+			    completed, timeouts, send_failures, errors.empty() ? " none" : errors.c_str());
+
+		} else {
+			LOG("HCI 0x%04x %s: %lu completed, %lu timed out, %lu send failures, errors:%s", known_opcodes[i].opcode,
+			    known_opcodes[i].name, completed, timeouts, send_failures, errors.empty() ? " none" : errors.c_str());
+		}
+
+		stats.latency.log("  controller latency");
+		stats.queued.log("  queued for credits");
+	}
+}
+
+} // end namespace bt
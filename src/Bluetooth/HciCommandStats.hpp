@@ -0,0 +1,48 @@
+#pragma once
+
+#include <latency_histogram.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace bt
+{
+
+// Per opcode command counters and latencies, fed by the command queue. Shows which
+// controller commands dominate the broadcast cycle and how often each one fails. Every opcode
+// this program sends has a fixed slot, so recording never locks or allocates.
+class HciCommandStats
+{
+public:
+	using Duration = std::chrono::steady_clock::duration;
+
+	// queued: submit until sent to the controller, latency: sent until Command Complete/Status
+	void record_completed(uint16_t opcode, uint8_t status, Duration queued, Duration latency);
+	void record_timeout(uint16_t opcode, Duration queued);
+	void record_send_failure(uint16_t opcode);
+
+	void print();
+
+private:
+	// Opcodes listed in HciCommandStats.cpp plus one slot shared by all others
+	static constexpr size_t KNOWN_OPCODES = 23;
+	static constexpr size_t OTHER_OPCODES = KNOWN_OPCODES;
+
+	struct OpcodeStats {
+		std::atomic<uint64_t> completed {};
+		std::atomic<uint64_t> timeouts {};
+		std::atomic<uint64_t> send_failures {};
+		// Indexed by HCI error code, success is not counted
+		std::atomic<uint64_t> errors[256] {};
+		LatencyHistogram queued;
+		LatencyHistogram latency;
+	};
+
+	static size_t slot(uint16_t opcode);
+
+	OpcodeStats _opcodes[KNOWN_OPCODES + 1];
+};
+
+} // end namespace bt
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Typed parameters of the HCI commands we send. Each command knows its opcode and the size of its
+// parameters at compile time and serializes into a fixed size array on the stack, field by field in
+// the order and width of the specification. The layouts are checked at the bottom of this file.
+namespace bt::hci
+{
+
+// BD_ADDR as sent over HCI
+using Address = std::array<uint8_t, 6>;
+
+// Generated addresses are kept as a string of the 6 raw bytes
+inline Address address(const std::string& mac)
+{
+	Address result = {};
+	memcpy(result.data(), mac.data(), std::min(mac.size(), result.size()));
+	return result;
+}
+
+// Advertising intervals in units of 0.625 ms, clamped to what the command accepts
+constexpr uint32_t interval_units(uint32_t interval_ms, uint32_t max)
+{
+	return std::clamp<uint32_t>((1000 * interval_ms) / 625, 0x000020, max);
+}
+
+// Little endian writer, length() is the number of bytes written
+template<size_t Capacity>
+class Parameters
+{
+public:
+	constexpr Parameters& u8(uint8_t value)
+	{
+		_bytes[_length++] = value;
+		return *this;
+	}
+
+	constexpr Parameters& u16(uint16_t value) { return u8(value & 0xFF).u8(value >> 8); }
+	constexpr Parameters& u24(uint32_t value) { return u16(value & 0xFFFF).u8((value >> 16) & 0xFF); }
+	constexpr Parameters& u32(uint32_t value) { return u16(value & 0xFFFF).u16(value >> 16); }
+	constexpr Parameters& u64(uint64_t value) { return u32(value & 0xFFFFFFFF).u32(value >> 32); }
+
+	constexpr Parameters& address(const Address& value)
+	{
+		for (auto byte : value) {
+			u8(byte);
+		}
+
+		return *this;
+	}
+
+	constexpr const uint8_t* data() const { return _bytes.data(); };
+	constexpr uint8_t length() const { return _length; };
+	constexpr uint8_t operator[](size_t index) const { return _bytes[index]; };
+
+private:
+	std::array<uint8_t, Capacity> _bytes {};
+	uint8_t _length {};
+};
+
+enum class AdvertisingPhy : uint8_t {
+	Le1M = 0x01,
+	LeCoded = 0x03,
+};
+
+// Advertising_Event_Properties
+static constexpr uint16_t ADVERTISING_EVENT_LEGACY = 0x0010; // Use legacy advertising PDUs
+static constexpr uint16_t ADVERTISING_EVENT_NONCONNECTABLE = 0x0000; // Non-connectable and non-scannable undirected
+
+// Events the controller may send. HCI_Reset masks the LE Meta event, the reset default is 0x00001FFFFFFFFFFF.
+struct SetEventMask {
+	static constexpr uint8_t OGF = OGF_HOST_CTL;
+	static constexpr uint16_t OCF = 0x0001;
+	static constexpr size_t SIZE = 8;
+
+	uint64_t event_mask {0x20001FFFFFFFFFFF}; // Reset default and bit 61, LE Meta event
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u64(event_mask);
+	}
+};
+
+// LE Meta sub-events the controller may send, the reset default 0x1F does not include the extended advertising ones
+struct LeSetEventMask {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x0001;
+	static constexpr size_t SIZE = 8;
+
+	uint64_t le_event_mask {0x000000000002001F}; // Reset default and bit 17, LE Advertising Set Terminated
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u64(le_event_mask);
+	}
+};
+
+struct LeSetRandomAddress {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = OCF_LE_SET_RANDOM_ADDRESS;
+	static constexpr size_t SIZE = 6;
+
+	Address random_address {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().address(random_address);
+	}
+};
+
+struct LeSetAdvertisingParameters {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = OCF_LE_SET_ADVERTISING_PARAMETERS;
+	static constexpr size_t SIZE = 15;
+	static constexpr uint32_t MAX_INTERVAL = 0x4000;
+
+	uint16_t interval_min {0x0800};       // N * 0.625 ms. 0x0800 = 1280 ms
+	uint16_t interval_max {0x0800};
+	uint8_t advertising_type {0x03};      // 3 = Non connectable undirected advertising (ADV_NONCONN_IND)
+	uint8_t own_address_type {0x01};      // 1 = Random Device Address
+	uint8_t peer_address_type {0x00};     // 0 = Public Device Address or Public Identity Address
+	Address peer_address {};
+	uint8_t channel_map {0x07};           // 7 = all three channels enabled
+	uint8_t filter_policy {0x00};         // 0 = Process scan and connection requests from all devices
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>()
+		       .u16(interval_min)
+		       .u16(interval_max)
+		       .u8(advertising_type)
+		       .u8(own_address_type)
+		       .u8(peer_address_type)
+		       .address(peer_address)
+		       .u8(channel_map)
+		       .u8(filter_policy);
+	}
+};
+
+struct LeSetAdvertiseEnable {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = OCF_LE_SET_ADVERTISE_ENABLE;
+	static constexpr size_t SIZE = 1;
+
+	bool enable {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(enable);
+	}
+};
+
+// Only the header, the advertising data follows it in the same command
+struct LeSetAdvertisingData {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = OCF_LE_SET_ADVERTISING_DATA;
+	static constexpr size_t SIZE = 1;
+	static constexpr size_t MAX_DATA_LENGTH = 31;
+
+	uint8_t data_length {}; // Significant octets of the 31 octet Advertising_Data
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(data_length);
+	}
+};
+
+struct LeSetAdvertisingSetRandomAddress {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x0035;
+	static constexpr size_t SIZE = 7;
+
+	uint8_t handle {};
+	Address random_address {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(handle).address(random_address);
+	}
+};
+
+struct LeSetExtendedAdvertisingParameters {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x0036;
+	static constexpr size_t SIZE = 25;
+	static constexpr uint32_t MAX_INTERVAL = 0xFFFFFF;
+
+	uint8_t handle {};
+	uint16_t event_properties {ADVERTISING_EVENT_LEGACY | ADVERTISING_EVENT_NONCONNECTABLE};
+	uint32_t interval_min {0x000800};     // N * 0.625 ms, 24 bit. 0x000800 = 1280 ms
+	uint32_t interval_max {0x000800};
+	uint8_t channel_map {0x07};           // 7 = all three channels enabled
+	uint8_t own_address_type {0x01};      // 1 = Random Device Address
+	uint8_t peer_address_type {0x00};     // 0 = Public Device Address or Public Identity Address
+	Address peer_address {};
+	uint8_t filter_policy {0x00};         // 0 = Process scan and connection requests from all devices
+	uint8_t tx_power {0x7F};              // 0x7F = Host has no preference
+	AdvertisingPhy primary_phy {AdvertisingPhy::Le1M};
+	uint8_t secondary_max_skip {0x00};    // 0 = AUX_ADV_IND shall be sent prior to the next advertising event
+	AdvertisingPhy secondary_phy {AdvertisingPhy::Le1M};
+	uint8_t sid {0x00};                   // Advertising SID subfield in the ADI field of the PDU
+	uint8_t scan_request_notification {}; // 0 = Scan request notifications disabled
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>()
+		       .u8(handle)
+		       .u16(event_properties)
+		       .u24(interval_min)
+		       .u24(interval_max)
+		       .u8(channel_map)
+		       .u8(own_address_type)
+		       .u8(peer_address_type)
+		       .address(peer_address)
+		       .u8(filter_policy)
+		       .u8(tx_power)
+		       .u8(uint8_t(primary_phy))
+		       .u8(secondary_max_skip)
+		       .u8(uint8_t(secondary_phy))
+		       .u8(sid)
+		       .u8(scan_request_notification);
+	}
+};
+
+// Only the header, the advertising data follows it in the same command
+struct LeSetExtendedAdvertisingData {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x0037;
+	static constexpr size_t SIZE = 4;
+	static constexpr size_t MAX_DATA_LENGTH = 251;
+
+	uint8_t handle {};
+	uint8_t operation {0x03};           // 3 = Complete extended advertising data
+	uint8_t fragment_preference {0x01}; // 1 = The Controller should not fragment or should minimize fragmentation
+	uint8_t data_length {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(handle).u8(operation).u8(fragment_preference).u8(data_length);
+	}
+};
+
+struct ExtendedAdvertisingSet {
+	uint8_t handle {};
+	uint16_t duration_10ms {}; // 0 = advertise until disabled
+	uint8_t max_events {};     // 0 = no maximum number of advertising events
+};
+
+// Sizes to the sets actually listed, the parameters have room for all of them
+template<size_t MaxSets>
+struct LeSetExtendedAdvertisingEnable {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x0039;
+	static constexpr size_t SIZE = 2 + 4 * MaxSets;
+
+	bool enable {};
+	uint8_t num_sets {}; // 0 with enable = false disables all sets
+	std::array<ExtendedAdvertisingSet, MaxSets> sets {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		Parameters<SIZE> parameters;
+		parameters.u8(enable).u8(num_sets);
+
+		for (size_t i = 0; i < std::min<size_t>(num_sets, MaxSets); i++) {
+			parameters.u8(sets[i].handle).u16(sets[i].duration_10ms).u8(sets[i].max_events);
+		}
+
+		return parameters;
+	}
+};
+
+struct LeRemoveAdvertisingSet {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x003C;
+	static constexpr size_t SIZE = 1;
+
+	uint8_t handle {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(handle);
+	}
+};
+
+struct LeSetPeriodicAdvertisingParameters {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x003E;
+	static constexpr size_t SIZE = 7;
+
+	uint8_t handle {};
+	uint16_t interval_min {0x0006}; // N * 1.25 ms, 0x0006 = 7.5 ms
+	uint16_t interval_max {0x0006};
+	uint16_t properties {};         // 0 = TxPower not included in the AUX_SYNC_IND
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(handle).u16(interval_min).u16(interval_max).u16(properties);
+	}
+};
+
+// Only the header, the advertising data follows it in the same command
+struct LeSetPeriodicAdvertisingData {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x003F;
+	static constexpr size_t SIZE = 3;
+	static constexpr size_t MAX_DATA_LENGTH = 252;
+
+	uint8_t handle {};
+	uint8_t operation {0x03}; // 3 = Complete periodic advertising data
+	uint8_t data_length {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(handle).u8(operation).u8(data_length);
+	}
+};
+
+struct LeSetPeriodicAdvertisingEnable {
+	static constexpr uint8_t OGF = OGF_LE_CTL;
+	static constexpr uint16_t OCF = 0x0040;
+	static constexpr size_t SIZE = 2;
+
+	bool enable {};
+	uint8_t handle {};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(enable).u8(handle);
+	}
+};
+
+struct WriteLeHostSupport {
+	static constexpr uint8_t OGF = OGF_HOST_CTL;
+	static constexpr uint16_t OCF = 0x006D;
+	static constexpr size_t SIZE = 2;
+
+	uint8_t le_supported_host {1};
+	uint8_t simultaneous_le_host {1};
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>().u8(le_supported_host).u8(simultaneous_le_host);
+	}
+};
+
+// ODID service data element leading every Remote ID advertisement, the encoded message or pack follows
+struct OdidServiceData {
+	static constexpr size_t SIZE = 6;
+	static constexpr size_t COUNTER_OFFSET = 5;
+
+	uint8_t payload_size {};
+	uint8_t counter {}; // 8-bit message counter starting at 0x00 and wrapping around at 0xFF
+
+	constexpr Parameters<SIZE> serialize() const
+	{
+		return Parameters<SIZE>()
+		       .u8(SIZE - 1 + payload_size) // Length of the following data
+		       .u8(0x16)                    // GAP AD Type = "Service Data - 16-bit UUID"
+		       .u16(0xFFFA)                 // ASTM International, ASTM Remote ID
+		       .u8(0x0D)                    // AD Application Code within the ASTM address space = Open Drone ID
+		       .u8(counter);
+	}
+};
+
+// Every field must land where the specification puts it, a wrong width shifts all that follow
+static_assert(SetEventMask().serialize().length() == SetEventMask::SIZE);
+static_assert(SetEventMask().serialize()[7] == 0x20);
+static_assert(LeSetEventMask().serialize()[0] == 0x1F && LeSetEventMask().serialize()[2] == 0x02);
+static_assert(LeSetRandomAddress().serialize().length() == LeSetRandomAddress::SIZE);
+static_assert(LeSetAdvertisingParameters().serialize().length() == LeSetAdvertisingParameters::SIZE);
+static_assert(LeSetAdvertisingParameters().serialize()[13] == 0x07);
+static_assert(LeSetAdvertisingSetRandomAddress().serialize().length() == LeSetAdvertisingSetRandomAddress::SIZE);
+static_assert(LeSetExtendedAdvertisingParameters().serialize().length() == LeSetExtendedAdvertisingParameters::SIZE);
+static_assert(LeSetExtendedAdvertisingParameters().serialize()[1] == 0x10);
+static_assert(LeSetExtendedAdvertisingParameters().serialize()[4] == 0x08);
+static_assert(LeSetExtendedAdvertisingParameters().serialize()[9] == 0x07);
+static_assert(LeSetExtendedAdvertisingParameters().serialize()[19] == 0x7F);
+static_assert(LeSetExtendedAdvertisingParameters { .primary_phy = AdvertisingPhy::LeCoded }.serialize()[20] == 0x03);
+static_assert(LeSetExtendedAdvertisingParameters { .secondary_phy = AdvertisingPhy::LeCoded }.serialize()[22] == 0x03);
+static_assert(LeSetExtendedAdvertisingData().serialize().length() == LeSetExtendedAdvertisingData::SIZE);
+static_assert(LeSetExtendedAdvertisingEnable<1> { .num_sets = 1 }.serialize().length() == 6);
+static_assert(LeSetExtendedAdvertisingEnable<1> { .num_sets = 1, .sets = {{{ .duration_10ms = 0x0102 }}} }.serialize()[3] == 0x02);
+static_assert(LeSetExtendedAdvertisingEnable<4> { .enable = false, .num_sets = 0 }.serialize().length() == 2);
+static_assert(LeSetPeriodicAdvertisingParameters().serialize().length() == LeSetPeriodicAdvertisingParameters::SIZE);
+static_assert(LeSetPeriodicAdvertisingParameters { .interval_max = 0x0320 }.serialize()[4] == 0x03);
+static_assert(LeSetPeriodicAdvertisingData().serialize().length() == LeSetPeriodicAdvertisingData::SIZE);
+static_assert(LeSetPeriodicAdvertisingEnable { .enable = true, .handle = 2 }.serialize()[1] == 0x02);
+static_assert(OdidServiceData { .payload_size = 25 }.serialize()[0] == 0x1E);
+static_assert(OdidServiceData().serialize()[2] == 0xFA && OdidServiceData().serialize()[3] == 0xFF);
+static_assert(OdidServiceData().serialize().length() == OdidServiceData::SIZE);
+
+} // end namespace bt::hci
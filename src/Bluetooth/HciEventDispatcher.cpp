@@ -0,0 +1,123 @@
+#include "HciEventDispatcher.hpp"
+
+#include <global_include.hpp>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+namespace bt
+{
+
+HciEventDispatcher::HciEventDispatcher(HciCommandQueue& command_queue)
+	: _command_queue(command_queue)
+{}
+
+void HciEventDispatcher::on_event(uint8_t event_code, EventHandler handler)
+{
+	_event_handlers[event_code] = std::move(handler);
+}
+
+void HciEventDispatcher::on_le_meta_event(uint8_t subevent, EventHandler handler)
+{
+	_le_meta_handlers[subevent] = std::move(handler);
+}
+
+void HciEventDispatcher::on_unsolicited_completion(uint16_t opcode, CompletionHandler handler)
+{
+	_completion_handlers[opcode] = std::move(handler);
+}
+
+void HciEventDispatcher::dispatch(const uint8_t* packet, size_t size)
+{
+	if (size < HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE) {
+		return;
+	}
+
+	const hci_event_hdr* hdr = (const hci_event_hdr*)(packet + HCI_TYPE_LEN);
+	const uint8_t* params = packet + HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE;
+
+	switch (hdr->evt) {
+	case EVT_CMD_COMPLETE: {
+		if (hdr->plen < EVT_CMD_COMPLETE_SIZE) {
+			break;
+		}
+
+		// | Num_HCI_Command_Packets | Opcode (2) | Status | Return Parameters |
+		const evt_cmd_complete* cc = (const evt_cmd_complete*)params;
+		CommandResult result = {};
+
+		if (hdr->plen > EVT_CMD_COMPLETE_SIZE) {
+			result.status = params[EVT_CMD_COMPLETE_SIZE];
+			result.params = &params[EVT_CMD_COMPLETE_SIZE + 1];
+			result.length = hdr->plen - EVT_CMD_COMPLETE_SIZE - 1;
+		}
+
+		dispatch_completion(btohs(cc->opcode), cc->ncmd, result);
+		return;
+	}
+
+	case EVT_CMD_STATUS: {
+		if (hdr->plen < EVT_CMD_STATUS_SIZE) {
+			break;
+		}
+
+		// | Status | Num_HCI_Command_Packets | Opcode (2) |
+		const evt_cmd_status* cs = (const evt_cmd_status*)params;
+		CommandResult result = {};
+		result.status = cs->status;
+
+		dispatch_completion(btohs(cs->opcode), cs->ncmd, result);
+		return;
+	}
+
+	case EVT_LE_META_EVENT: {
+		if (hdr->plen < 1) {
+			break;
+		}
+
+		auto handler = _le_meta_handlers.find(params[0]);
+
+		if (handler != _le_meta_handlers.end()) {
+			handler->second(&params[1], hdr->plen - 1);
+			return;
+		}
+
+		_unhandled++;
+		LOG("Unhandled LE meta event: 0x%X", params[0]);
+		return;
+	}
+
+	default: {
+		auto handler = _event_handlers.find(hdr->evt);
+
+		if (handler != _event_handlers.end()) {
+			handler->second(params, hdr->plen);
+			return;
+		}
+
+		break;
+	}
+	}
+
+	_unhandled++;
+	LOG("Unhandled event: 0x%X", hdr->evt);
+}
+
+void HciEventDispatcher::dispatch_completion(uint16_t opcode, uint8_t ncmd, const CommandResult& result)
+{
+	if (_command_queue.complete(opcode, ncmd, result) || opcode == 0x0000) {
+		return;
+	}
+
+	auto handler = _completion_handlers.find(opcode);
+
+	if (handler != _completion_handlers.end()) {
+		handler->second(result);
+		return;
+	}
+
+	_unhandled++;
+	LOG("Unsolicited completion: ogf 0x%x ocf 0x%x status 0x%x", cmd_opcode_ogf(opcode), cmd_opcode_ocf(opcode), result.status);
+}
+
+} // end namespace bt
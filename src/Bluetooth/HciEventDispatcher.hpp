@@ -0,0 +1,46 @@
+#pragma once
+
+#include "HciCommandQueue.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+namespace bt
+{
+
+// Routes every HCI event to a handler. Command Complete/Status go to the command queue first and
+// fall through to the opcode handlers when no command is waiting for them, LE Meta events are routed
+// by sub-event code and everything else by event code. Register handlers before the reactor starts.
+class HciEventDispatcher
+{
+public:
+	// params points at the event parameters, after the event header (or after the sub-event code)
+	using EventHandler = std::function<void(const uint8_t* params, uint8_t length)>;
+	using CompletionHandler = std::function<void(const CommandResult& result)>;
+
+	HciEventDispatcher(HciCommandQueue& command_queue);
+
+	void on_event(uint8_t event_code, EventHandler handler);
+	void on_le_meta_event(uint8_t subevent, EventHandler handler);
+	// Command Complete/Status that no submitted command is waiting for
+	void on_unsolicited_completion(uint16_t opcode, CompletionHandler handler);
+
+	// Takes a complete HCI event packet including the packet type
+	void dispatch(const uint8_t* packet, size_t size);
+
+	uint64_t unhandled_events() const { return _unhandled; };
+
+private:
+	void dispatch_completion(uint16_t opcode, uint8_t ncmd, const CommandResult& result);
+
+	HciCommandQueue& _command_queue;
+
+	std::unordered_map<uint8_t, EventHandler> _event_handlers;
+	std::unordered_map<uint8_t, EventHandler> _le_meta_handlers;
+	std::unordered_map<uint16_t, CompletionHandler> _completion_handlers;
+
+	uint64_t _unhandled {};
+};
+
+} // end namespace bt
@@ -0,0 +1,151 @@
+#include "HciReactor.hpp"
+
+#include <global_include.hpp>
+
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+namespace bt
+{
+
+HciReactor::HciReactor(std::shared_ptr<HciTransport> transport)
+	: _transport(transport)
+{}
+
+HciReactor::~HciReactor()
+{
+	stop();
+}
+
+bool HciReactor::start(PacketHandler on_packet, TimeoutHandler on_timeout, FailureHandler on_failure)
+{
+	_on_packet = std::move(on_packet);
+	_on_timeout = std::move(on_timeout);
+	_on_failure = std::move(on_failure);
+
+	_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	// steady_clock is CLOCK_MONOTONIC
+	_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (_epoll_fd < 0 || _timer_fd < 0 || _wake_fd < 0) {
+		LOG(RED_TEXT "HCI reactor setup failed" NORMAL_TEXT);
+		stop();
+		return false;
+	}
+
+	for (int fd : { _transport->fd(), _timer_fd, _wake_fd }) {
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+
+		if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			LOG(RED_TEXT "HCI reactor epoll_ctl failed" NORMAL_TEXT);
+			stop();
+			return false;
+		}
+	}
+
+	_thread = std::thread(&HciReactor::run, this);
+
+	return true;
+}
+
+void HciReactor::stop()
+{
+	if (_thread.joinable()) {
+		uint64_t one = 1;
+
+		if (::write(_wake_fd, &one, sizeof(one)) < 0) {
+			LOG(RED_TEXT "HCI reactor wakeup failed" NORMAL_TEXT);
+		}
+
+		_thread.join();
+	}
+
+	for (int* fd : { &_epoll_fd, &_timer_fd, &_wake_fd }) {
+		if (*fd >= 0) {
+			::close(*fd);
+			*fd = -1;
+		}
+	}
+}
+
+void HciReactor::set_deadline(std::chrono::steady_clock::time_point deadline)
+{
+	struct itimerspec spec = {};
+
+	if (deadline != std::chrono::steady_clock::time_point::max()) {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+		// An all zero it_value would disarm the timer
+		ns = std::max<int64_t>(ns, 1);
+		spec.it_value.tv_sec = ns / 1000000000;
+		spec.it_value.tv_nsec = ns % 1000000000;
+	}
+
+	timerfd_settime(_timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void HciReactor::run()
+{
+	struct epoll_event events[3] = {};
+	uint8_t buf[HCI_MAX_EVENT_SIZE] = {};
+
+	while (true) {
+		int count = epoll_wait(_epoll_fd, events, 3, -1);
+
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			LOG(RED_TEXT "HCI reactor epoll_wait failed" NORMAL_TEXT);
+			return;
+		}
+
+		for (int i = 0; i < count; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == _wake_fd) {
+				return;
+
+			} else if (fd == _timer_fd) {
+				uint64_t expirations = 0;
+
+				if (::read(_timer_fd, &expirations, sizeof(expirations)) > 0) {
+					_on_timeout();
+				}
+
+			} else {
+				ssize_t bytes_read = _transport->read(buf, sizeof(buf));
+				bool failed = false;
+
+				if (bytes_read < 0 && errno != EAGAIN && errno != EINTR) {
+					LOG(RED_TEXT "read error" NORMAL_TEXT);
+					failed = true;
+
+				} else if (bytes_read == 0) {
+					LOG(RED_TEXT "HCI transport hung up" NORMAL_TEXT);
+					failed = true;
+
+				} else if (bytes_read > 0) {
+					_on_packet(buf, bytes_read);
+				}
+
+				// Nothing will be answered anymore, stop polling the transport but keep running the timer
+				if (failed) {
+					epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+					_on_failure();
+				}
+			}
+		}
+	}
+}
+
+} // end namespace bt
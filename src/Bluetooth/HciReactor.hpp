@@ -0,0 +1,49 @@
+#pragma once
+
+#include "HciTransport.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+
+namespace bt
+{
+
+// Reads HCI events on a dedicated thread. Sleeps in epoll until the controller sends
+// something or the timerfd deadline passes, so an idle controller costs no CPU.
+// A transport that fails is reported once and dropped, the timer keeps running until stop().
+class HciReactor
+{
+public:
+	using PacketHandler = std::function<void(const uint8_t* packet, size_t size)>;
+	using TimeoutHandler = std::function<void()>;
+	using FailureHandler = std::function<void()>;
+
+	HciReactor(std::shared_ptr<HciTransport> transport);
+	~HciReactor();
+
+	bool start(PacketHandler on_packet, TimeoutHandler on_timeout, FailureHandler on_failure);
+	void stop();
+
+	// Fires on_timeout once the monotonic deadline passes. time_point::max() disarms the timer.
+	void set_deadline(std::chrono::steady_clock::time_point deadline);
+
+	std::thread::native_handle_type native_handle() { return _thread.native_handle(); };
+
+private:
+	void run();
+
+	std::shared_ptr<HciTransport> _transport {};
+
+	PacketHandler _on_packet {};
+	TimeoutHandler _on_timeout {};
+	FailureHandler _on_failure {};
+
+	int _epoll_fd {-1};
+	int _timer_fd {-1};
+	int _wake_fd {-1};
+	std::thread _thread;
+};
+
+} // end namespace bt
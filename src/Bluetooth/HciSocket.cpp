@@ -0,0 +1,74 @@
+#include "HciSocket.hpp"
+
+#include <global_include.hpp>
+
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+namespace bt
+{
+
+HciSocket::HciSocket(const std::string& device_name)
+	: _device_name(device_name)
+{}
+
+HciSocket::~HciSocket()
+{
+	close();
+}
+
+bool HciSocket::open()
+{
+	struct hci_filter filter; // Host Controller Interface filter
+
+	int device_id = hci_devid(_device_name.c_str());
+
+	if (device_id < 0) {
+		LOG(RED_TEXT "Getting device id failed" NORMAL_TEXT);
+		device_id = hci_get_route(NULL);
+	}
+
+	int device_descriptor = hci_open_dev(device_id);
+
+	if (device_descriptor < 0) {
+		LOG(RED_TEXT "Device open failed" NORMAL_TEXT);
+		return false;
+	}
+
+	hci_filter_clear(&filter);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+	hci_filter_all_events(&filter);
+
+	if (setsockopt(device_descriptor, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0) {
+		LOG(RED_TEXT "CI filter setup failed" NORMAL_TEXT);
+		hci_close_dev(device_descriptor);
+		return false;
+	}
+
+	_fd = device_descriptor;
+
+	return true;
+}
+
+void HciSocket::close()
+{
+	if (_fd >= 0) {
+		hci_close_dev(_fd);
+		_fd = -1;
+	}
+}
+
+bool HciSocket::send_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length)
+{
+	return hci_send_cmd(_fd, ogf, ocf, length, const_cast<uint8_t*>(data)) >= 0;
+}
+
+ssize_t HciSocket::read(uint8_t* buf, size_t size)
+{
+	return ::read(_fd, buf, size);
+}
+
+} // end namespace bt
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "HciTransport.hpp"
+
+#include <string>
+
+namespace bt
+{
+
+// BlueZ raw HCI socket
+class HciSocket : public HciTransport
+{
+public:
+	HciSocket(const std::string& device_name);
+	~HciSocket() override;
+
+	bool open() override;
+	void close() override;
+
+	int fd() const override { return _fd; };
+
+	bool send_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length) override;
+	ssize_t read(uint8_t* buf, size_t size) override;
+
+private:
+	std::string _device_name {};
+	int _fd {-1};
+};
+
+} // end namespace bt
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+
+namespace bt
+{
+
+// Byte level access to an HCI controller. Commands go out as HCI command packets and
+// events come back as complete HCI event packets (including the packet type byte).
+class HciTransport
+{
+public:
+	virtual ~HciTransport() = default;
+
+	virtual bool open() = 0;
+	virtual void close() = 0;
+
+	// Readable when an HCI packet is available
+	virtual int fd() const = 0;
+
+	virtual bool send_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length) = 0;
+
+	// Returns bytes read, 0 if no data is available and -1 on error
+	virtual ssize_t read(uint8_t* buf, size_t size) = 0;
+};
+
+} // end namespace bt
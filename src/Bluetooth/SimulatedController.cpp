@@ -0,0 +1,411 @@
+#include "SimulatedController.hpp"
+
+#include <global_include.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+namespace bt
+{
+
+SimulatedController::SimulatedController(const SimulatedControllerSettings& settings)
+	: _settings(settings)
+{}
+
+SimulatedController::~SimulatedController()
+{
+	close();
+}
+
+bool SimulatedController::open()
+{
+	int fds[2] = {};
+
+	// SEQPACKET preserves packet boundaries like the HCI socket does
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		LOG(RED_TEXT "Simulated controller socketpair failed" NORMAL_TEXT);
+		return false;
+	}
+
+	_host_fd = fds[0];
+	_controller_fd = fds[1];
+	_thread = std::thread(&SimulatedController::run, this);
+
+	LOG("Using simulated controller: latency %u us, %u command credits", _settings.command_latency_us, _settings.command_credits);
+
+	return true;
+}
+
+void SimulatedController::close()
+{
+	if (_host_fd < 0) {
+		return;
+	}
+
+	// Hangs up the controller end which stops the controller thread
+	shutdown(_host_fd, SHUT_RDWR);
+
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+
+	::close(_host_fd);
+	::close(_controller_fd);
+	_host_fd = -1;
+	_controller_fd = -1;
+}
+
+bool SimulatedController::send_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length)
+{
+	uint8_t buf[HCI_TYPE_LEN + HCI_COMMAND_HDR_SIZE + UINT8_MAX] = {};
+	uint16_t opcode = htobs(cmd_opcode_pack(ogf, ocf));
+
+	buf[0] = HCI_COMMAND_PKT;
+	memcpy(&buf[1], &opcode, sizeof(opcode));
+	buf[3] = length;
+
+	if (length) {
+		memcpy(&buf[4], data, length);
+	}
+
+	ssize_t size = HCI_TYPE_LEN + HCI_COMMAND_HDR_SIZE + length;
+	return ::write(_host_fd, buf, size) == size;
+}
+
+ssize_t SimulatedController::read(uint8_t* buf, size_t size)
+{
+	return ::read(_host_fd, buf, size);
+}
+
+void SimulatedController::print_stats()
+{
+	LOG("Simulated controller: %lu commands, %lu credit violations, %lu injected errors, %lu dropped",
+	    _commands.load(), _credit_violations.load(), _injected_errors.load(), _dropped_commands.load());
+
+	if (_terminated_sets.load()) {
+		LOG("Simulated controller: %lu advertising sets terminated, %lu not reported because the host masked the event",
+		    _terminated_sets.load(), _masked_events.load());
+		LOG("Simulated controller: %lu periodic trains outlived their set, longest for %.1f ms", _orphaned_trains.load(),
+		    _longest_orphaned_us.load() / 1000.0);
+	}
+}
+
+void SimulatedController::run()
+{
+	uint8_t buf[HCI_TYPE_LEN + HCI_COMMAND_HDR_SIZE + UINT8_MAX] = {};
+
+	while (true) {
+		struct timespec timeout = {};
+		struct timespec* timeout_ptr = nullptr;
+
+		auto due = _pending.empty() ? Clock::time_point::max() : _pending.front().due;
+
+		for (auto& [handle, timeout] : _set_timeouts) {
+			due = std::min(due, timeout);
+		}
+
+		if (due != Clock::time_point::max()) {
+			auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(due - Clock::now()).count();
+			wait = std::max<int64_t>(wait, 0);
+			timeout.tv_sec = wait / 1000000000;
+			timeout.tv_nsec = wait % 1000000000;
+			timeout_ptr = &timeout;
+		}
+
+		struct pollfd pfd = { _controller_fd, POLLIN, 0 };
+
+		if (ppoll(&pfd, 1, timeout_ptr, nullptr) > 0) {
+			ssize_t bytes_read = ::read(_controller_fd, buf, sizeof(buf));
+
+			if (bytes_read <= 0) {
+				// Host hung up
+				break;
+			}
+
+			handle_command(buf, bytes_read);
+		}
+
+		write_due_events();
+		terminate_expired_sets();
+	}
+}
+
+void SimulatedController::handle_command(const uint8_t* packet, ssize_t length)
+{
+	if (length < HCI_TYPE_LEN + HCI_COMMAND_HDR_SIZE || packet[0] != HCI_COMMAND_PKT) {
+		LOG(RED_TEXT "Simulated controller: malformed command" NORMAL_TEXT);
+		return;
+	}
+
+	uint16_t opcode = btohs(uint16_t(packet[1] | (packet[2] << 8)));
+
+	_commands++;
+
+	if (_in_flight >= _settings.command_credits) {
+		LOG(RED_TEXT "Simulated controller: command 0x%04x sent without credit" NORMAL_TEXT, opcode);
+		_credit_violations++;
+	}
+
+	bool matches = _settings.error_opcode == 0 || _settings.error_opcode == opcode;
+
+	if (matches && _uniform(_rng) < _settings.drop_rate) {
+		_dropped_commands++;
+		return;
+	}
+
+	uint8_t status = 0x00;
+
+	if (matches && _uniform(_rng) < _settings.error_rate) {
+		_injected_errors++;
+		status = _settings.error_status;
+	}
+
+	uint8_t params[9] = {};
+	uint8_t params_length = 0;
+
+	switch (opcode) {
+	case cmd_opcode_pack(OGF_INFO_PARAM, 0x0001): // Read Local Version Information
+		params[0] = _settings.hci_version;
+		params[3] = _settings.hci_version; // LMP_Version
+		params[4] = 0xFF; // Company_Identifier: 0xFFFF, not assigned
+		params[5] = 0xFF;
+		params_length = 8;
+		break;
+
+	case cmd_opcode_pack(OGF_INFO_PARAM, 0x0009): // Read BD_ADDR
+		memcpy(params, _settings.address, sizeof(_settings.address));
+		params_length = sizeof(_settings.address);
+		break;
+
+	case cmd_opcode_pack(OGF_INFO_PARAM, 0x0003): // Read Local Supported Features
+		memcpy(params, &_settings.hci_features, sizeof(_settings.hci_features));
+		params_length = sizeof(_settings.hci_features);
+		break;
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x0003): // LE Read Local Supported Features
+		memcpy(params, &_settings.le_features, sizeof(_settings.le_features));
+		params_length = sizeof(_settings.le_features);
+		break;
+
+	case cmd_opcode_pack(OGF_HOST_CTL, 0x006C): // Read LE Host Support
+		params[0] = 1; // LE_Supported_Host
+		params_length = 2;
+		break;
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x0036): // LE Set Extended Advertising Parameters
+		params[0] = 0; // Selected_TX_Power: 0 dBm
+		params_length = 1;
+		break;
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x003A): // LE Read Maximum Advertising Data Length
+		params[0] = _settings.max_advertising_data_length & 0xFF;
+		params[1] = (_settings.max_advertising_data_length >> 8) & 0xFF;
+		params_length = 2;
+		break;
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x003B): // LE Read Number of Supported Advertising Sets
+		params[0] = _settings.num_advertising_sets;
+		params_length = 1;
+		break;
+
+	default:
+		break;
+	}
+
+	if (status == 0x00) {
+		update_advertising_state(opcode, &packet[HCI_TYPE_LEN + HCI_COMMAND_HDR_SIZE],
+					 std::min<ssize_t>(packet[3], length - HCI_TYPE_LEN - HCI_COMMAND_HDR_SIZE));
+	}
+
+	_in_flight++;
+	queue_command_complete(opcode, status, params, params_length);
+
+	if (status == 0x00 && _settings.spurious_data_complete && opcode == cmd_opcode_pack(OGF_LE_CTL, 0x0036)) {
+		queue_command_complete(cmd_opcode_pack(OGF_LE_CTL, 0x0037), 0x00, nullptr, 0);
+		_pending.back().command = false;
+	}
+}
+
+void SimulatedController::queue_command_complete(uint16_t opcode, uint8_t status, const uint8_t* params, uint8_t length)
+{
+	PendingEvent event = {};
+
+	// | Packet Type | Event Code | Parameter Total Length | Num_HCI_Command_Packets | Opcode (2) | Status | Return Parameters |
+	event.packet.resize(HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE + 1 + length);
+	event.packet[0] = HCI_EVENT_PKT;
+	event.packet[1] = EVT_CMD_COMPLETE;
+	event.packet[2] = EVT_CMD_COMPLETE_SIZE + 1 + length;
+	event.packet[4] = opcode & 0xFF;
+	event.packet[5] = (opcode >> 8) & 0xFF;
+	event.packet[6] = status;
+
+	if (length) {
+		memcpy(&event.packet[7], params, length);
+	}
+
+	// The controller works through its queue one command at a time
+	auto now = Clock::now();
+	_busy_until = std::max(_busy_until, now) + std::chrono::microseconds(_settings.command_latency_us);
+	event.due = _busy_until;
+
+	_pending.push_back(std::move(event));
+}
+
+void SimulatedController::update_advertising_state(uint16_t opcode, const uint8_t* params, uint8_t length)
+{
+	switch (opcode) {
+	case cmd_opcode_pack(OGF_HOST_CTL, 0x0003): // Reset
+		_event_mask = 0x00001FFFFFFFFFFF;
+		_le_event_mask = 0x1F;
+		_set_timeouts.clear();
+		_periodic_trains.clear();
+		break;
+
+	case cmd_opcode_pack(OGF_HOST_CTL, 0x0001): // Set Event Mask
+		if (length >= 8) memcpy(&_event_mask, params, 8);
+
+		break;
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x0001): // LE Set Event Mask
+		if (length >= 8) memcpy(&_le_event_mask, params, 8);
+
+		break;
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x0039): { // LE Set Extended Advertising Enable
+		// Enable | Num_Sets | Num_Sets * (Advertising_Handle | Duration (2) | Max_Extended_Advertising_Events)
+		if (length < 2) {
+			break;
+		}
+
+		bool enable = params[0];
+		uint8_t num_sets = std::min<uint8_t>(params[1], (length - 2) / 4);
+
+		if (!enable && num_sets == 0) {
+			_set_timeouts.clear();
+		}
+
+		for (uint8_t i = 0; i < num_sets; i++) {
+			const uint8_t* set = &params[2 + 4 * i];
+			uint16_t duration_10ms = set[1] | (set[2] << 8);
+
+			// Enabling an enabled set restarts its duration
+			if (enable && duration_10ms) {
+				_set_timeouts[set[0]] = Clock::now() + std::chrono::milliseconds(10 * duration_10ms);
+
+			} else {
+				_set_timeouts.erase(set[0]);
+			}
+
+			// A train whose set advertises again is no longer on its own
+			if (enable && _periodic_trains.count(set[0])) {
+				end_orphaned_train(set[0]);
+			}
+		}
+
+		break;
+	}
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x0040): // LE Set Periodic Advertising Enable
+		// Enable | Advertising_Handle
+		if (length < 2) {
+			break;
+		}
+
+		if (params[0] && !_periodic_trains.count(params[1])) {
+			_periodic_trains[params[1]] = Clock::time_point::max();
+
+		} else if (!params[0] && _periodic_trains.count(params[1])) {
+			end_orphaned_train(params[1]);
+			_periodic_trains.erase(params[1]);
+		}
+
+		break;
+
+	case cmd_opcode_pack(OGF_LE_CTL, 0x003C): // LE Remove Advertising Set
+		if (length >= 1) _set_timeouts.erase(params[0]);
+
+		break;
+
+	default:
+		break;
+	}
+}
+
+void SimulatedController::terminate_expired_sets()
+{
+	auto now = Clock::now();
+
+	for (auto it = _set_timeouts.begin(); it != _set_timeouts.end();) {
+		if (now < it->second) {
+			++it;
+			continue;
+		}
+
+		uint8_t handle = it->first;
+		it = _set_timeouts.erase(it);
+		_terminated_sets++;
+
+		auto train = _periodic_trains.find(handle);
+
+		if (train != _periodic_trains.end()) {
+			train->second = now;
+		}
+
+		// LE Meta is bit 61 of the event mask, LE Advertising Set Terminated bit 17 of the LE event mask
+		if (!(_event_mask & (1ull << 61)) || !(_le_event_mask & (1ull << 17))) {
+			_masked_events++;
+			continue;
+		}
+
+		// | Packet Type | Event Code | Parameter Total Length | Subevent_Code | Status | Advertising_Handle |
+		// Connection_Handle (2) | Num_Completed_Extended_Advertising_Events |
+		uint8_t packet[] = { HCI_EVENT_PKT, EVT_LE_META_EVENT, 6, 0x12, 0x3C, handle, 0x00, 0x00, 0x00 };
+
+		if (::write(_controller_fd, packet, sizeof(packet)) < 0) {
+			LOG(RED_TEXT "Simulated controller: write failed" NORMAL_TEXT);
+		}
+	}
+}
+
+void SimulatedController::end_orphaned_train(uint8_t handle)
+{
+	auto& terminated = _periodic_trains[handle];
+
+	if (terminated != Clock::time_point::max()) {
+		auto orphaned_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - terminated).count();
+		_orphaned_trains++;
+		_longest_orphaned_us.store(std::max<int64_t>(_longest_orphaned_us.load(), orphaned_us));
+		terminated = Clock::time_point::max();
+	}
+}
+
+void SimulatedController::write_due_events()
+{
+	auto now = Clock::now();
+
+	while (!_pending.empty() && _pending.front().due <= now) {
+		auto& event = _pending.front();
+
+		if (event.command) {
+			_in_flight--;
+		}
+
+		// Credits returned to the host are whatever is left after this completion
+		auto& packet = event.packet;
+		packet[3] = _in_flight >= _settings.command_credits ? 0 : uint8_t(_settings.command_credits - _in_flight);
+
+		if (::write(_controller_fd, packet.data(), packet.size()) < 0) {
+			LOG(RED_TEXT "Simulated controller: write failed" NORMAL_TEXT);
+		}
+
+		_pending.pop_front();
+	}
+}
+
+} // end namespace bt
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "HciTransport.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace bt
+{
+
+struct SimulatedControllerSettings {
+	// Time the controller takes to complete each command. Commands are processed in order.
+	uint32_t command_latency_us {500};
+	// Num_HCI_Command_Packets: commands the controller accepts before a completion
+	uint8_t command_credits {1};
+	// Read Local Version Information and Read BD_ADDR, least significant byte first
+	uint8_t hci_version {0x09}; // Bluetooth 5.0
+	uint8_t address[6] {0x01, 0x00, 0x00, 0x5E, 0xD1, 0xC0};
+	// Feature bits returned by LE Read Local Supported Features and Read Local Supported Features
+	uint64_t le_features {0x3900}; // LE 2M PHY, LE Coded PHY, LE Extended Advertising, LE Periodic Advertising
+	uint64_t hci_features {0x0000004000000000}; // LE Supported (Controller)
+	uint16_t max_advertising_data_length {1650};
+	uint8_t num_advertising_sets {16};
+	// Some controllers also complete LE Set Extended Advertising Data after setting the parameters
+	bool spurious_data_complete {true};
+	// Error injection. Matching commands (any command if error_opcode is 0) fail with error_status
+	// with probability error_rate or are never completed with probability drop_rate.
+	double error_rate {};
+	double drop_rate {};
+	uint8_t error_status {0x0C}; // Command Disallowed
+	uint16_t error_opcode {};
+};
+
+// User space LE controller running on its own thread behind a socket pair. The host side
+// behaves like a BlueZ raw HCI socket so the whole stack can run without a radio.
+// Advertising sets enabled with a duration terminate once it runs out, reported with
+// LE Advertising Set Terminated if the host unmasked it. Their periodic advertising trains keep
+// running, as on a radio, until the host disables them or enables the set again.
+class SimulatedController : public HciTransport
+{
+public:
+	SimulatedController(const SimulatedControllerSettings& settings);
+	~SimulatedController() override;
+
+	bool open() override;
+	void close() override;
+
+	int fd() const override { return _host_fd; };
+
+	bool send_command(uint8_t ogf, uint16_t ocf, const uint8_t* data, uint8_t length) override;
+	ssize_t read(uint8_t* buf, size_t size) override;
+
+	void print_stats();
+
+	std::thread::native_handle_type native_handle() { return _thread.native_handle(); };
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct PendingEvent {
+		Clock::time_point due;
+		std::vector<uint8_t> packet;
+		bool command {true};
+	};
+
+	void run();
+	void handle_command(const uint8_t* packet, ssize_t length);
+	void queue_command_complete(uint16_t opcode, uint8_t status, const uint8_t* params, uint8_t length);
+	void write_due_events();
+	// Tracks the masks and the set durations from the commands the host sent
+	void update_advertising_state(uint16_t opcode, const uint8_t* params, uint8_t length);
+	void terminate_expired_sets();
+	// Records how long the train ran without its set, if it did
+	void end_orphaned_train(uint8_t handle);
+
+	SimulatedControllerSettings _settings {};
+
+	int _host_fd {-1};
+	int _controller_fd {-1};
+	std::thread _thread;
+
+	// Controller thread state
+	std::deque<PendingEvent> _pending;
+	Clock::time_point _busy_until {};
+	size_t _in_flight {};
+	std::mt19937 _rng {0x0D1D};
+	std::uniform_real_distribution<double> _uniform {0.0, 1.0};
+	// Reset defaults, the LE Meta event and LE Advertising Set Terminated are masked
+	uint64_t _event_mask {0x00001FFFFFFFFFFF};
+	uint64_t _le_event_mask {0x1F};
+	// Advertising handle -> time its duration runs out
+	std::map<uint8_t, Clock::time_point> _set_timeouts;
+	// Advertising handles of the enabled periodic trains, with the time their set terminated if it did
+	std::map<uint8_t, Clock::time_point> _periodic_trains;
+
+	std::atomic<uint64_t> _commands {};
+	std::atomic<uint64_t> _credit_violations {};
+	std::atomic<uint64_t> _injected_errors {};
+	std::atomic<uint64_t> _dropped_commands {};
+	std::atomic<uint64_t> _terminated_sets {};
+	std::atomic<uint64_t> _masked_events {};
+	std::atomic<uint64_t> _orphaned_trains {};
+	std::atomic<int64_t> _longest_orphaned_us {};
+};
+
+} // end namespace bt
@@ -0,0 +1,242 @@
+#include "BroadcastScheduler.hpp"
+
+#include <global_include.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+namespace txr
+{
+
+using namespace std::chrono;
+
+static constexpr auto MISS_REPORT_INTERVAL = seconds(10);
+
+static double to_ms(steady_clock::duration duration)
+{
+	return duration_cast<microseconds>(duration).count() / 1000.0;
+}
+
+const char* message_type_name(MessageType type)
+{
+	switch (type) {
+	case MessageType::BasicId:
+		return "basic_id";
+
+	case MessageType::Location:
+		return "location";
+
+	case MessageType::System:
+		return "system";
+
+	case MessageType::OperatorId:
+		return "operator_id";
+
+	case MessageType::SelfId:
+		return "self_id";
+
+	case MessageType::Pack:
+		return "pack";
+	}
+
+	return "unknown";
+}
+
+const char* transport_name(Transport transport)
+{
+	return transport == Transport::Legacy ? "legacy" : "extended";
+}
+
+double MessageRates::rate(MessageType type) const
+{
+	switch (type) {
+	case MessageType::BasicId:
+		return basic_id;
+
+	case MessageType::Location:
+		return location;
+
+	case MessageType::System:
+		return system;
+
+	case MessageType::OperatorId:
+		return operator_id;
+
+	case MessageType::SelfId:
+		return self_id;
+
+	case MessageType::Pack:
+		return pack;
+	}
+
+	return 0;
+}
+
+BroadcastScheduler::BroadcastScheduler(const ScheduleSettings& settings)
+	: _settings(settings)
+{}
+
+void BroadcastScheduler::add(MessageType type, Transport transport, int channel)
+{
+	double rate = (transport == Transport::Legacy ? _settings.legacy : _settings.extended).rate(type);
+
+	if (rate <= 0) {
+		return;
+	}
+
+	auto now = Clock::now();
+
+	// Stagger the first deadlines so messages sharing a channel do not all start out late
+	auto on_channel = std::count_if(_messages.begin(), _messages.end(), [channel](auto & m) { return m.channel == channel; });
+
+	ScheduledMessage message = {
+		.type = type,
+		.transport = transport,
+		.channel = channel,
+		.period = duration_cast<Clock::duration>(duration<double>(1.0 / rate)),
+		.deadline = now + on_channel * milliseconds(_settings.message_spacing_ms),
+		.sent = 0,
+		.missed = 0,
+		.max_lateness = {},
+	};
+
+	_messages.push_back(message);
+
+	if (channel >= int(_channel_free_at.size())) {
+		_channel_free_at.resize(channel + 1, now);
+	}
+}
+
+void BroadcastScheduler::log_schedule()
+{
+	for (auto& message : _messages) {
+		LOG("Scheduling %s on %s at %.2f Hz", message_type_name(message.type), transport_name(message.transport),
+		    1.0 / duration<double>(message.period).count());
+	}
+
+	check_channel_load();
+}
+
+void BroadcastScheduler::scale_rates(double factor)
+{
+	for (auto& message : _messages) {
+		double rate = (message.transport == Transport::Legacy ? _settings.legacy : _settings.extended).rate(message.type);
+		message.period = duration_cast<Clock::duration>(duration<double>(1.0 / (rate * factor)));
+	}
+
+	check_channel_load();
+}
+
+void BroadcastScheduler::check_channel_load()
+{
+	std::map<int, double> channel_load;
+
+	for (auto& message : _messages) {
+		channel_load[message.channel] += _settings.message_spacing_ms / 1000.0 / duration<double>(message.period).count();
+	}
+
+	for (auto& [channel, load] : channel_load) {
+		if (load > 1.0) {
+			LOG(RED_TEXT "Advertising channel %d is scheduled for %.0f%% of its airtime, deadlines will be missed" NORMAL_TEXT,
+			    channel, load * 100);
+		}
+	}
+}
+
+void BroadcastScheduler::start()
+{
+	if (_messages.empty()) {
+		return;
+	}
+
+	auto now = Clock::now();
+	auto first = std::min_element(_messages.begin(), _messages.end(), [](auto & a, auto & b) { return a.deadline < b.deadline; });
+	auto shift = now - first->deadline;
+
+	for (auto& message : _messages) {
+		message.deadline += shift;
+	}
+
+	std::fill(_channel_free_at.begin(), _channel_free_at.end(), now);
+	_miss_report_time = now + MISS_REPORT_INTERVAL;
+}
+
+ScheduledMessage& BroadcastScheduler::next(Clock::time_point* when)
+{
+	ScheduledMessage* earliest = &_messages.front();
+	*when = Clock::time_point::max();
+
+	// Messages waiting for the same channel go earliest deadline first, otherwise an overloaded
+	// channel would only ever send the message added first. Remaining ties go to the message added first.
+	for (auto& message : _messages) {
+		auto start = std::max(message.deadline, _channel_free_at[message.channel]);
+
+		if (start < *when || (start == *when && message.deadline < earliest->deadline)) {
+			*when = start;
+			earliest = &message;
+		}
+	}
+
+	return *earliest;
+}
+
+void BroadcastScheduler::sent(ScheduledMessage& message, Clock::time_point started, Clock::time_point finished)
+{
+	auto lateness = started - message.deadline;
+
+	message.sent++;
+	message.max_lateness = std::max(message.max_lateness, lateness);
+
+	if (lateness > milliseconds(_settings.deadline_tolerance_ms)) {
+		message.missed++;
+
+		if (_window_misses++ == 0 || lateness > _window_worst_lateness) {
+			_window_worst = &message - _messages.data();
+			_window_worst_lateness = lateness;
+		}
+	}
+
+	_channel_free_at[message.channel] = finished + milliseconds(_settings.message_spacing_ms);
+
+	advance(message, finished);
+
+	if (finished >= _miss_report_time) {
+		if (_window_misses) {
+			auto& worst = _messages[_window_worst];
+			LOG(RED_TEXT "%lu deadline misses in the last %lds, worst %s on %s %.1f ms late" NORMAL_TEXT,
+			    _window_misses, long(MISS_REPORT_INTERVAL.count()), message_type_name(worst.type),
+			    transport_name(worst.transport), to_ms(_window_worst_lateness));
+		}
+
+		_window_misses = 0;
+		_miss_report_time = finished + MISS_REPORT_INTERVAL;
+	}
+}
+
+void BroadcastScheduler::skipped(ScheduledMessage& message)
+{
+	advance(message, Clock::now());
+}
+
+void BroadcastScheduler::advance(ScheduledMessage& message, Clock::time_point now)
+{
+	message.deadline += message.period;
+
+	// More than a period behind, drop the periods we cannot make up instead of sending a burst
+	if (message.deadline + message.period <= now) {
+		auto behind = (now - message.deadline) / message.period;
+		message.deadline += behind * message.period;
+		message.missed += behind;
+	}
+}
+
+void BroadcastScheduler::print_stats()
+{
+	for (auto& message : _messages) {
+		LOG("%s on %s: %lu sent, %lu missed, max %.1f ms late", message_type_name(message.type),
+		    transport_name(message.transport), message.sent, message.missed, to_ms(message.max_lateness));
+	}
+}
+
+} // end namespace txr
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace txr
+{
+
+enum class MessageType {
+	BasicId,
+	Location,
+	System,
+	OperatorId,
+	SelfId,
+	Pack, // All of the above in one extended advertisement
+};
+
+static constexpr int MESSAGE_TYPES = 6;
+
+enum class Transport {
+	Legacy,
+	Extended,
+};
+
+const char* message_type_name(MessageType type);
+const char* transport_name(Transport transport);
+
+// Broadcast rates in Hz, 0 disables the message. ASTM F3411 requires Location at 1 Hz or
+// faster and the static messages at least every 3 seconds.
+struct MessageRates {
+	double basic_id {1.0};
+	double location {4.0};
+	double system {1.0};
+	double operator_id {0.5};
+	double self_id {0.5};
+	// Sent instead of the single messages when message packs are used
+	double pack {4.0};
+
+	double rate(MessageType type) const;
+};
+
+struct ScheduleSettings {
+	MessageRates legacy {};
+	MessageRates extended {};
+	// Time an advertisement stays on air before the next message may replace it
+	uint32_t message_spacing_ms {30};
+	// Sending later than this after the deadline counts as a miss. Messages sharing a channel
+	// can delay each other by a few message spacings.
+	uint32_t deadline_tolerance_ms {100};
+};
+
+struct ScheduledMessage {
+	MessageType type;
+	Transport transport;
+	// Messages on the same channel replace each other on air and are kept message_spacing_ms apart
+	int channel;
+	std::chrono::steady_clock::duration period;
+	std::chrono::steady_clock::time_point deadline;
+
+	uint64_t sent;
+	uint64_t missed;
+	std::chrono::steady_clock::duration max_lateness;
+};
+
+// Keeps a timeline of absolute deadlines on the monotonic clock, one per message and transport,
+// each advancing by its own period. Deadlines never drift with the time spent sending.
+class BroadcastScheduler
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	BroadcastScheduler(const ScheduleSettings& settings);
+
+	// Adds the message if its configured rate is not zero
+	void add(MessageType type, Transport transport, int channel);
+
+	const std::vector<ScheduledMessage>& messages() const { return _messages; };
+	bool empty() const { return _messages.empty(); };
+
+	// Logs the schedule and warns about channels that cannot keep up with their rates
+	void log_schedule();
+	// Multiplies every configured rate by factor, e.g. by the number of UAS sharing each message in relay mode.
+	// Takes effect from the next deadline.
+	void scale_rates(double factor);
+	// Moves the first deadline to now, call once the advertisements are set up
+	void start();
+
+	// Message to send next and the earliest time it may go out
+	ScheduledMessage& next(Clock::time_point* when);
+
+	// Moves the deadline on by one period. Sends started more than the tolerance late count as misses.
+	void sent(ScheduledMessage& message, Clock::time_point started, Clock::time_point finished);
+	// Nothing to send this period, e.g. the message was not received yet
+	void skipped(ScheduledMessage& message);
+
+	void print_stats();
+
+private:
+	void check_channel_load();
+	void advance(ScheduledMessage& message, Clock::time_point now);
+
+	ScheduleSettings _settings {};
+	std::vector<ScheduledMessage> _messages;
+	std::vector<Clock::time_point> _channel_free_at;
+
+	// Misses are summarized periodically rather than logged one by one
+	Clock::time_point _miss_report_time {};
+	uint64_t _window_misses {};
+	size_t _window_worst {};
+	Clock::duration _window_worst_lateness {};
+};
+
+} // end namespace txr
@@ -0,0 +1,893 @@
+#include <Broadcaster.hpp>
+#include <Transmitter.hpp>
+#include <OdidConversion.hpp>
+#include <HciSocket.hpp>
+#include <BtsnoopCapture.hpp>
+#include <algorithm>
+#include <mutex>
+
+namespace txr
+{
+
+const char* adapter_role_name(AdapterRole role)
+{
+	switch (role) {
+	case AdapterRole::Both:
+		return "legacy and extended";
+
+	case AdapterRole::Legacy:
+		return "legacy";
+
+	case AdapterRole::Extended:
+		return "extended";
+	}
+
+	return "unknown";
+}
+
+const char* advertising_mode_name(AdvertisingMode mode)
+{
+	switch (mode) {
+	case AdvertisingMode::Toggle:
+		return "toggle";
+
+	case AdvertisingMode::Persistent:
+		return "persistent";
+
+	case AdvertisingMode::MultiSet:
+		return "multi_set";
+
+	case AdvertisingMode::Auto:
+		return "auto";
+	}
+
+	return "unknown";
+}
+
+Broadcaster::Broadcaster(const Settings& settings, const AdapterSettings& adapter, const std::string& mac,
+			 const std::map<uint8_t, std::string>& relay_macs)
+	: _settings(settings)
+	, _adapter(adapter)
+	, _mac(mac)
+	, _relay_macs(relay_macs)
+	, _max_uas(settings.relay ? settings.relay_max_uas : 1)
+	, _scheduler(settings.schedule)
+	, _created(Clock::now())
+{
+	_uas = std::make_unique<Uas[]>(_max_uas);
+	_encoded_locations_ok = std::make_unique<bool[]>(_max_uas);
+	std::fill(std::begin(_uas_index), std::end(_uas_index), -1);
+
+	// Without relaying everything is broadcast for the autopilot from the address all adapters share
+	if (!_settings.relay) {
+		_uas[0].sysid = 1;
+		_uas[0].serial_number = _settings.uas_serial_number;
+		_uas_count.store(1);
+	}
+}
+
+bool Broadcaster::initialize()
+{
+	std::shared_ptr<bt::HciTransport> transport;
+
+	if (_adapter.device == "sim") {
+		_simulator = std::make_shared<bt::SimulatedController>(_settings.simulator);
+		transport = _simulator;
+
+	} else {
+		transport = std::make_shared<bt::HciSocket>(_adapter.device);
+	}
+
+	if (!_settings.hci_capture_dir.empty()) {
+		std::string path = _settings.hci_capture_dir + "/" + _adapter.device + ".btsnoop";
+		transport = std::make_shared<bt::BtsnoopCapture>(transport, path, size_t(_settings.hci_capture_size_mb) * 1024 * 1024);
+	}
+
+	LOG("Broadcasting %s advertisements on %s", adapter_role_name(_adapter.role), _adapter.device.c_str());
+	_bluetooth = std::make_shared<bt::Bluetooth>(transport, _mac);
+
+	// The simulated controller is configured per run, caching it would hide changed settings
+	return _bluetooth->initialize(_simulator.get() ? std::string() : _settings.capability_cache_dir);
+}
+
+bool Broadcaster::broadcasts(Transport transport) const
+{
+	// Bluetooth 4 controllers only have legacy advertising
+	if (transport == Transport::Extended && _bluetooth.get() && !_bluetooth->capabilities().extended_advertising()) {
+		return false;
+	}
+
+	switch (_adapter.role) {
+	case AdapterRole::Both:
+		return true;
+
+	case AdapterRole::Legacy:
+		return transport == Transport::Legacy;
+
+	case AdapterRole::Extended:
+		return transport == Transport::Extended;
+	}
+
+	return false;
+}
+
+bool Broadcaster::update(const mavlink_message_t& message)
+{
+	switch (message.msgid) {
+	case MAVLINK_MSG_ID_HEARTBEAT:
+
+		// Only the autopilot's heartbeat describes the UAS
+		if (message.compid != MAV_COMP_ID_AUTOPILOT1 || (!_settings.relay && message.sysid != 1)) {
+			return false;
+		}
+
+		break;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_LOCATION:
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_SYSTEM:
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_OPERATOR_ID:
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_SELF_ID:
+		break;
+
+	default:
+		return false;
+	}
+
+	Uas* uas = find_uas(message.sysid);
+
+	if (!uas) {
+		return false;
+	}
+
+	switch (message.msgid) {
+	case MAVLINK_MSG_ID_HEARTBEAT:
+		mavlink_msg_heartbeat_decode(&message, &uas->heartbeat_msg.back());
+		uas->heartbeat_msg.publish();
+		break;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_LOCATION:
+		mavlink_msg_open_drone_id_location_decode(&message, &uas->location_msg.back());
+		uas->location_msg.publish();
+		break;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_SYSTEM:
+		mavlink_msg_open_drone_id_system_decode(&message, &uas->system_msg.back());
+		uas->system_msg.publish();
+		break;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_OPERATOR_ID:
+		mavlink_msg_open_drone_id_operator_id_decode(&message, &uas->operator_id_msg.back());
+		uas->operator_id_msg.publish();
+		break;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_SELF_ID:
+		mavlink_msg_open_drone_id_self_id_decode(&message, &uas->self_id_msg.back());
+		uas->self_id_msg.publish();
+		break;
+	}
+
+	return true;
+}
+
+Broadcaster::Uas* Broadcaster::find_uas(uint8_t sysid)
+{
+	if (!_settings.relay) {
+		return &_uas[0];
+	}
+
+	if (_uas_index[sysid] >= 0) {
+		return &_uas[_uas_index[sysid]];
+	}
+
+	if (_uas_ignored[sysid]) {
+		return nullptr;
+	}
+
+	auto serial_number = _settings.relay_serial_numbers.find(sysid);
+	size_t count = _uas_count.load(std::memory_order_relaxed);
+
+	if (serial_number == _settings.relay_serial_numbers.end()) {
+		LOG(RED_TEXT "%s: no serial number configured for system %u, not relaying it" NORMAL_TEXT, _adapter.device.c_str(), sysid);
+		_uas_ignored.set(sysid);
+		return nullptr;
+	}
+
+	if (count == _max_uas) {
+		LOG(RED_TEXT "%s: already relaying %zu UAS, not relaying system %u" NORMAL_TEXT, _adapter.device.c_str(), count, sysid);
+		_uas_ignored.set(sysid);
+		return nullptr;
+	}
+
+	Uas& uas = _uas[count];
+	uas.sysid = sysid;
+	uas.serial_number = serial_number->second;
+	uas.mac = _relay_macs.at(sysid);
+	_uas_index[sysid] = count;
+
+	// Publishes the entry to the broadcast loop
+	_uas_count.store(count + 1, std::memory_order_release);
+
+	LOG("%s: relaying system %u as %s", _adapter.device.c_str(), sysid, uas.serial_number.c_str());
+	return &uas;
+}
+
+void Broadcaster::run()
+{
+	if (_settings.realtime.enabled) {
+		set_realtime_scheduling(pthread_self(), _settings.realtime, _adapter.device.c_str());
+		set_realtime_scheduling(_bluetooth->reactor_thread(), _settings.realtime, _adapter.device.c_str());
+		prefault_stack();
+	}
+
+	_use_message_pack = _settings.message_pack && message_pack_fits();
+
+	setup_schedule();
+
+	bool toggle = _mode == AdvertisingMode::Toggle;
+
+	if (_scheduler.empty()) {
+		LOG(RED_TEXT "All message rates are zero, nothing to broadcast" NORMAL_TEXT);
+		return;
+	}
+
+	if (!toggle) {
+		setup_advertising_sets();
+
+	} else if (_settings.periodic_location) {
+		LOG(RED_TEXT "%s: periodic advertising needs multi_set mode" NORMAL_TEXT, _adapter.device.c_str());
+	}
+
+	if (_settings.periodic_location && _use_message_pack) {
+		LOG(RED_TEXT "%s: the message pack carries Location, it is not sent on a periodic advertising train" NORMAL_TEXT,
+		    _adapter.device.c_str());
+	}
+
+	_scheduler.start();
+	auto refresh_time = Clock::now();
+
+	while (!_should_exit) {
+
+		// Sleep until the next deadline, or until the advertisement before it had its time on air
+		Clock::time_point when;
+		ScheduledMessage& message = _scheduler.next(&when);
+
+		// The messages due so far go out back to back, the controller takes them while this thread waits
+		if (when > Clock::now()) {
+			_bluetooth->flush_advertising_data();
+		}
+
+		if (when > Clock::now()) {
+			sleep_until_monotonic(when);
+			_wakeup_latency.record(Clock::now() - when);
+		}
+
+		if (_should_exit) {
+			break;
+		}
+
+		if (_stats_requested.exchange(false)) {
+			print_stats();
+		}
+
+		// Relay mode: every UAS is broadcast at the configured rates, as far as the airtime allows
+		size_t uas_count = std::max<size_t>(_uas_count.load(std::memory_order_acquire), 1);
+
+		if (uas_count != _scheduled_uas) {
+			LOG("%s: broadcasting for %zu UAS", _adapter.device.c_str(), uas_count);
+			_scheduler.scale_rates(uas_count);
+			_scheduled_uas = uas_count;
+		}
+
+		auto started = Clock::now();
+
+		// Restart the set timeout, it only expires when this loop stalls
+		if (!toggle && _settings.advertising_set_timeout_ms &&
+		    started - refresh_time >= std::chrono::milliseconds(_settings.advertising_set_timeout_ms / 2)) {
+			_bluetooth->refresh_advertising_sets(_advertising_sets);
+			refresh_time = started;
+		}
+
+		if (send_message(message)) {
+			_scheduler.sent(message, started, Clock::now());
+
+			if (!_first_sent) {
+				LOG("%s: first advertisement %.1f ms after startup", _adapter.device.c_str(),
+				    std::chrono::duration<double, std::milli>(Clock::now() - _created).count());
+				_first_sent = true;
+			}
+
+		} else {
+			_scheduler.skipped(message);
+		}
+	}
+
+	// Only this thread sends advertising commands, nothing enables advertising again after this
+	_bluetooth->stop();
+
+	print_stats();
+}
+
+void Broadcaster::print_stats()
+{
+	// Adapters print from their own threads, keep each adapter's statistics together
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+
+	LOG(CYAN_TEXT "%s (%s), %zu UAS" NORMAL_TEXT, _adapter.device.c_str(), adapter_role_name(_adapter.role), _uas_count.load());
+	_scheduler.print_stats();
+	_wakeup_latency.log("broadcast thread wake up latency");
+	print_data_age();
+	_bluetooth->print_command_stats();
+
+	if (_simulator.get()) _simulator->print_stats();
+}
+
+AdvertisingMode Broadcaster::select_advertising_mode(size_t messages) const
+{
+	auto& capabilities = _bluetooth->capabilities();
+	size_t sets = capabilities.extended_advertising() ? capabilities.num_advertising_sets : 0;
+	size_t transports = broadcasts(Transport::Legacy) + broadcasts(Transport::Extended);
+
+	// Multi set mode needs a set per message, persistent mode one per transport
+	AdvertisingMode best = AdvertisingMode::Toggle;
+
+	if (sets >= messages) {
+		best = AdvertisingMode::MultiSet;
+
+	} else if (sets >= transports) {
+		best = AdvertisingMode::Persistent;
+	}
+
+	AdvertisingMode mode = _settings.advertising_mode;
+
+	if (mode == AdvertisingMode::Auto) {
+		return best;
+	}
+
+	if (mode == AdvertisingMode::MultiSet && best != AdvertisingMode::MultiSet) {
+		LOG(RED_TEXT "%s: %zu advertising sets for %zu messages, multi_set mode not possible" NORMAL_TEXT,
+		    _adapter.device.c_str(), sets, messages);
+		return best;
+	}
+
+	if (mode == AdvertisingMode::Persistent && best == AdvertisingMode::Toggle) {
+		LOG(RED_TEXT "%s: %zu advertising sets, persistent mode not possible" NORMAL_TEXT, _adapter.device.c_str(), sets);
+		return best;
+	}
+
+	return mode;
+}
+
+void Broadcaster::setup_schedule()
+{
+	static constexpr MessageType singles[] = {
+		MessageType::Location,
+		MessageType::BasicId,
+		MessageType::System,
+		MessageType::OperatorId,
+		MessageType::SelfId,
+	};
+
+	// Extended advertisements carry the whole pack, legacy advertisements always need single messages
+	std::vector<std::pair<MessageType, Transport>> messages;
+
+	auto add = [this, &messages](MessageType type, Transport transport) {
+		auto& rates = transport == Transport::Legacy ? _settings.schedule.legacy : _settings.schedule.extended;
+
+		if (broadcasts(transport) && rates.rate(type) > 0) {
+			messages.push_back({type, transport});
+		}
+	};
+
+	for (auto type : singles) {
+		add(type, Transport::Legacy);
+	}
+
+	if (_use_message_pack) {
+		add(MessageType::Pack, Transport::Extended);
+
+	} else {
+		for (auto type : singles) {
+			add(type, Transport::Extended);
+		}
+	}
+
+	_mode = select_advertising_mode(messages.size());
+	LOG("%s: %s advertising mode", _adapter.device.c_str(), advertising_mode_name(_mode));
+
+	// Toggle mode has one advertisement on air at a time, persistent mode one per transport
+	// and multi set mode one per message. The channel doubles as the advertising set handle.
+	auto channel = [this](Transport transport) {
+		switch (_mode) {
+		case AdvertisingMode::Toggle:
+			return 0;
+
+		case AdvertisingMode::Persistent:
+			return int(transport);
+
+		case AdvertisingMode::MultiSet:
+		case AdvertisingMode::Auto:
+			break;
+		}
+
+		return int(_scheduler.messages().size());
+	};
+
+	for (auto& [type, transport] : messages) {
+		_scheduler.add(type, transport, channel(transport));
+	}
+
+	_scheduler.log_schedule();
+	_next_uas.resize(_scheduler.messages().size());
+
+	for (auto& message : _scheduler.messages()) {
+		if (message.channel >= int(_channel_uas.size())) {
+			_channel_uas.resize(message.channel + 1, -1);
+		}
+	}
+}
+
+void Broadcaster::setup_advertising_sets()
+{
+	uint16_t duration_10ms = (_settings.advertising_set_timeout_ms + 9) / 10;
+
+	for (auto& message : _scheduler.messages()) {
+		uint8_t handle = message.channel;
+		bool exists = std::any_of(_advertising_sets.begin(), _advertising_sets.end(), [handle](auto & set) { return set.handle == handle; });
+
+		if (!exists) {
+			bool legacy = message.transport == Transport::Legacy;
+			uint16_t periodic_interval = _settings.periodic_location ? periodic_interval_ms(message) : 0;
+			_advertising_sets.push_back({ .handle = handle, .legacy_pdus = legacy, .duration_10ms = duration_10ms,
+						      .periodic_interval_ms = periodic_interval });
+
+			if (periodic_interval) {
+				LOG("%s: %s on a periodic advertising train every %u ms", _adapter.device.c_str(),
+				    message_type_name(message.type), periodic_interval);
+				_periodic_sets.set(handle);
+			}
+		}
+	}
+
+	_bluetooth->enable_advertising_sets(_advertising_sets);
+}
+
+uint16_t Broadcaster::periodic_interval_ms(const ScheduledMessage& message) const
+{
+	// The message pack stays on the extended advertisements, scanners that do not synchronize still get it
+	if (message.transport != Transport::Extended || message.type != MessageType::Location) {
+		return 0;
+	}
+
+	if (!_bluetooth->capabilities().periodic_advertising()) {
+		LOG(RED_TEXT "%s: controller does not support periodic advertising" NORMAL_TEXT, _adapter.device.c_str());
+		return 0;
+	}
+
+	// Receivers synchronize to one address, relayed UAS take turns on the set with their own
+	if (_settings.relay) {
+		LOG(RED_TEXT "%s: periodic advertising is not used in relay mode" NORMAL_TEXT, _adapter.device.c_str());
+		return 0;
+	}
+
+	// The extended advertisements only point to the train, anything else sent from the set would be lost
+	auto& messages = _scheduler.messages();
+	bool shared = std::any_of(messages.begin(), messages.end(), [&message](auto & m) { return m.channel == message.channel && &m != &message; });
+
+	if (shared) {
+		LOG(RED_TEXT "%s: %s shares its advertising set, periodic advertising needs multi_set mode" NORMAL_TEXT,
+		    _adapter.device.c_str(), message_type_name(message.type));
+		return 0;
+	}
+
+	// One train event per scheduled update
+	double rate = _settings.schedule.extended.rate(message.type);
+	return std::clamp<double>(1000.0 / rate, 8, 0xFFFF);
+}
+
+bool Broadcaster::message_pack_fits()
+{
+	ODID_MessagePack_encoded pack = {};
+	pack.MsgPackSize = 5; // Basic ID, Location/Vector, System, Operator ID, Self-ID
+	uint16_t required = bt::Bluetooth::advertising_data_length(&pack);
+	uint16_t available = _bluetooth->max_advertising_data_length();
+
+	if (required > available) {
+		LOG("Message pack needs %u bytes of advertising data but the controller supports %u, sending single messages",
+		    required, available);
+		return false;
+	}
+
+	LOG("Sending message packs over extended advertising");
+	return true;
+}
+
+uint64_t Broadcaster::source_version(Uas& uas, MessageType type)
+{
+	switch (type) {
+	case MessageType::BasicId:
+		return uas.heartbeat_msg.read().version;
+
+	case MessageType::Location:
+		return uas.location_msg.read().version;
+
+	case MessageType::System:
+		return uas.system_msg.read().version;
+
+	case MessageType::OperatorId:
+		return uas.operator_id_msg.read().version;
+
+	case MessageType::SelfId:
+		return uas.self_id_msg.read().version;
+
+	case MessageType::Pack:
+		break;
+	}
+
+	// Versions only increase, so the sum changes whenever any packed message changed
+	uint64_t version = 0;
+
+	for (auto packed : PACKED_MESSAGES) {
+		version += source_version(uas, packed);
+	}
+
+	return version;
+}
+
+Broadcaster::Clock::time_point Broadcaster::update_uas_data(Uas& uas, MessageType type, struct ODID_UAS_Data* data)
+{
+	Clock::time_point received {};
+
+	switch (type) {
+	case MessageType::BasicId: {
+			auto& snapshot = uas.heartbeat_msg.read();
+			received = snapshot.published;
+			convert_basic_id(snapshot.value, uas.serial_number.c_str(), &data->BasicID[0]);
+			break;
+		}
+
+	case MessageType::Location: {
+			auto& snapshot = uas.location_msg.read();
+			received = snapshot.published;
+
+			// Until the autopilot reports a position, broadcast one with every field unknown
+			if (snapshot.version) {
+				convert_location(snapshot.value, &data->Location);
+
+			} else {
+				odid_initLocationData(&data->Location);
+			}
+
+			break;
+		}
+
+	case MessageType::System: {
+			auto& snapshot = uas.system_msg.read();
+			received = snapshot.published;
+			data->SystemValid = snapshot.version != 0;
+			convert_system(snapshot.value, &data->System);
+			break;
+		}
+
+	case MessageType::OperatorId: {
+			auto& snapshot = uas.operator_id_msg.read();
+			received = snapshot.published;
+			data->OperatorIDValid = snapshot.version != 0;
+			convert_operator_id(snapshot.value, &data->OperatorID);
+			break;
+		}
+
+	case MessageType::SelfId: {
+			auto& snapshot = uas.self_id_msg.read();
+			received = snapshot.published;
+			data->SelfIDValid = snapshot.version != 0;
+			convert_self_id(snapshot.value, &data->SelfID);
+			break;
+		}
+
+	case MessageType::Pack:
+		// The pack is as old as its Location, the other messages are mostly static
+		for (auto packed : PACKED_MESSAGES) {
+			auto packed_received = update_uas_data(uas, packed, data);
+
+			if (packed == MessageType::Location) {
+				received = packed_received;
+			}
+		}
+
+		break;
+	}
+
+	return received;
+}
+
+bool Broadcaster::encode_message(MessageType type, struct ODID_UAS_Data* data, ODID_Message_encoded* encoded)
+{
+	int result = ODID_SUCCESS;
+
+	switch (type) {
+	case MessageType::BasicId:
+		result = encodeBasicIDMessage((ODID_BasicID_encoded*) encoded, &data->BasicID[0]);
+		break;
+
+	case MessageType::Location:
+		result = encodeLocationMessage((ODID_Location_encoded*) encoded, &data->Location);
+		break;
+
+	case MessageType::System:
+		if (!data->SystemValid) {
+			return false;
+		}
+
+		result = encodeSystemMessage((ODID_System_encoded*) encoded, &data->System);
+		break;
+
+	case MessageType::OperatorId:
+		if (!data->OperatorIDValid) {
+			return false;
+		}
+
+		result = encodeOperatorIDMessage((ODID_OperatorID_encoded*) encoded, &data->OperatorID);
+		break;
+
+	case MessageType::SelfId:
+		if (!data->SelfIDValid) {
+			return false;
+		}
+
+		result = encodeSelfIDMessage((ODID_SelfID_encoded*) encoded, &data->SelfID);
+		break;
+
+	case MessageType::Pack:
+		return false;
+	}
+
+	if (result != ODID_SUCCESS) {
+		LOG(RED_TEXT "failed to encode %s" NORMAL_TEXT, message_type_name(type));
+		return false;
+	}
+
+	return true;
+}
+
+bool Broadcaster::encode_message_pack(struct ODID_UAS_Data* data, ODID_MessagePack_encoded* pack)
+{
+	ODID_MessagePack_data pack_data = {};
+	pack_data.SingleMessageSize = ODID_MESSAGE_SIZE;
+
+	// Operator ID and Self-ID are left out until received
+	for (auto type : PACKED_MESSAGES) {
+		if (encode_message(type, data, &pack_data.Messages[pack_data.MsgPackSize])) {
+			pack_data.MsgPackSize++;
+		}
+	}
+
+	if (encodeMessagePack(pack, &pack_data)) {
+		LOG(RED_TEXT "failed to encode Message Pack" NORMAL_TEXT);
+		return false;
+	}
+
+	return true;
+}
+
+bool Broadcaster::build_frame(Uas& uas, const ScheduledMessage& message, CachedFrame* cached)
+{
+	bt::AdvertisingDataFrame* frame = &cached->frame;
+
+	// Fill in the data from mavlink messages
+	struct ODID_UAS_Data data = {};
+	cached->received = update_uas_data(uas, message.type, &data);
+
+	if (cached->received != Clock::time_point {}) {
+		_data_age[int(message.type)][int(message.transport)].encoded.record(Clock::now() - cached->received);
+	}
+
+	if (message.type == MessageType::Pack) {
+		ODID_MessagePack_encoded pack = {};
+
+		if (!encode_message_pack(&data, &pack)) {
+			return false;
+		}
+
+		// Toggle mode advertises on set 0, the other modes use the channel as set handle
+		uint8_t handle = _mode == AdvertisingMode::Toggle ? 0 : message.channel;
+		bt::Bluetooth::build_extended_advertising_data(frame, handle, &pack);
+		return true;
+	}
+
+	union ODID_Message_encoded encoded = {};
+
+	if (!encode_message(message.type, &data, &encoded)) {
+		return false;
+	}
+
+	build_message_frame(message, &encoded, frame);
+	return true;
+}
+
+void Broadcaster::build_message_frame(const ScheduledMessage& message, const ODID_Message_encoded* encoded, bt::AdvertisingDataFrame* frame)
+{
+	bool toggle = _mode == AdvertisingMode::Toggle;
+
+	// Toggle mode sends legacy advertisements with the legacy commands, the other modes from a set with legacy PDUs
+	if (message.transport == Transport::Legacy && toggle) {
+		bt::Bluetooth::build_legacy_advertising_data(frame, encoded);
+
+	} else if (!toggle && _periodic_sets.test(message.channel)) {
+		bt::Bluetooth::build_periodic_advertising_data(frame, message.channel, encoded);
+
+	} else {
+		bt::Bluetooth::build_extended_advertising_data(frame, toggle ? 0 : message.channel, encoded);
+	}
+}
+
+void Broadcaster::refresh_locations(const ScheduledMessage& message, size_t count)
+{
+	size_t slot = &message - _scheduler.messages().data();
+
+	_location_batch.clear();
+	_pending_locations.clear();
+
+	for (size_t index = 0; index < count; index++) {
+		Uas& uas = _uas[index];
+
+		if (uas.frames.size() != _scheduler.messages().size()) {
+			uas.frames.resize(_scheduler.messages().size());
+		}
+
+		auto& cached = uas.frames[slot];
+		auto& snapshot = uas.location_msg.read();
+
+		// Without a position yet the frame is built one by one
+		if (snapshot.version == 0 || (cached.built && cached.version == snapshot.version)) {
+			continue;
+		}
+
+		_location_batch.push_back(snapshot.value);
+		_pending_locations.push_back({index, snapshot.version, snapshot.published});
+	}
+
+	if (_pending_locations.empty()) {
+		return;
+	}
+
+	_encoded_locations.resize(_pending_locations.size());
+	_location_encoder.encode(_location_batch, _encoded_locations.data(), _encoded_locations_ok.get());
+
+	auto now = Clock::now();
+
+	// The frames are now up to date, send_message() finds them cached
+	for (size_t i = 0; i < _pending_locations.size(); i++) {
+		auto& pending = _pending_locations[i];
+		auto& cached = _uas[pending.index].frames[slot];
+
+		cached.version = pending.version;
+		cached.received = pending.received;
+		cached.built = _encoded_locations_ok[i];
+
+		if (cached.received != Clock::time_point {}) {
+			_data_age[int(message.type)][int(message.transport)].encoded.record(now - cached.received);
+		}
+
+		if (!cached.built) {
+			LOG(RED_TEXT "failed to encode %s" NORMAL_TEXT, message_type_name(message.type));
+			continue;
+		}
+
+		union ODID_Message_encoded encoded = {};
+		encoded.location = _encoded_locations[i];
+		build_message_frame(message, &encoded, &cached.frame);
+	}
+}
+
+bool Broadcaster::send_message(const ScheduledMessage& message)
+{
+	size_t slot = &message - _scheduler.messages().data();
+	size_t count = _uas_count.load(std::memory_order_acquire);
+
+	if (_settings.relay && message.type == MessageType::Location) {
+		refresh_locations(message, count);
+	}
+
+	// Round robin, every UAS gets an equal share of each scheduled message
+	for (size_t tried = 0; tried < count; tried++) {
+		size_t index = _next_uas[slot]++ % count;
+
+		if (send_message(index, message)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Broadcaster::send_message(size_t index, const ScheduledMessage& message)
+{
+	Uas& uas = _uas[index];
+
+	if (uas.frames.size() != _scheduler.messages().size()) {
+		uas.frames.resize(_scheduler.messages().size());
+	}
+
+	// Only encode again when the MAVLink data changed since the frame was built
+	auto& cached = uas.frames[&message - _scheduler.messages().data()];
+	uint64_t version = source_version(uas, message.type);
+
+	if (!cached.built || cached.version != version) {
+		cached.built = build_frame(uas, message, &cached);
+		cached.version = version;
+	}
+
+	if (!cached.built) {
+		return false;
+	}
+
+	bool toggle = _mode == AdvertisingMode::Toggle;
+
+	// Legacy and extended advertising cannot be enabled together, switch when the transport changes
+	if (toggle && _toggle_transport != message.transport) {
+		if (_toggle_transport == Transport::Legacy) {
+			_bluetooth->disable_legacy_advertising();
+
+		} else if (_toggle_transport == Transport::Extended) {
+			_bluetooth->disable_le_extended_advertising();
+		}
+
+		if (message.transport == Transport::Legacy) {
+			_bluetooth->enable_legacy_advertising();
+
+		} else {
+			_bluetooth->enable_le_extended_advertising();
+		}
+
+		_toggle_transport = message.transport;
+		_channel_uas[message.channel] = -1;
+	}
+
+	// Relayed UAS each advertise from their own address, the advertisement is paused while it changes
+	bool legacy_commands = toggle && message.transport == Transport::Legacy;
+	bt::AdvertisingSet set = {};
+	bool change_address = !uas.mac.empty() && _channel_uas[message.channel] != int(index);
+
+	if (change_address) {
+		if (!toggle) {
+			set = *std::find_if(_advertising_sets.begin(), _advertising_sets.end(), [&message](auto & s) { return s.handle == message.channel; });
+		}
+
+		_bluetooth->change_advertising_address(set, uas.mac, legacy_commands);
+		_channel_uas[message.channel] = index;
+	}
+
+	// Age of the data once the controller has it, nothing to measure before the first MAVLink message
+	bt::CommandCallback on_complete;
+
+	if (cached.received != Clock::time_point {}) {
+		on_complete = [age = &_data_age[int(message.type)][int(message.transport)], received = cached.received](auto&) {
+			age->acknowledged.record(Clock::now() - received);
+		};
+	}
+
+	// Each message has a unique counter
+	_bluetooth->send_advertising_data(&cached.frame, ++uas.msg_counters[int(message.type)], std::move(on_complete));
+
+	if (change_address) {
+		_bluetooth->resume_advertising(set, legacy_commands);
+	}
+
+	return true;
+}
+
+void Broadcaster::print_data_age()
+{
+	for (auto& message : _scheduler.messages()) {
+		auto& age = _data_age[int(message.type)][int(message.transport)];
+		char label[64];
+
+		snprintf(label, sizeof(label), "%s on %s data age at encode", message_type_name(message.type), transport_name(message.transport));
+		age.encoded.log(label);
+		snprintf(label, sizeof(label), "%s on %s data age at controller ack", message_type_name(message.type), transport_name(message.transport));
+		age.acknowledged.log(label);
+	}
+}
+
+} // end namespace txr
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <Bluetooth.hpp>
+#include <SimulatedController.hpp>
+#include <BroadcastScheduler.hpp>
+#include <LocationBatch.hpp>
+
+#include <mavsdk/plugins/mavlink_passthrough/mavlink_passthrough.h>
+
+#include <atomic>
+#include <bitset>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <global_include.hpp>
+#include <latency_histogram.hpp>
+#include <triple_buffer.hpp>
+
+
+namespace txr
+{
+
+struct Settings;
+
+// Messages that go into a message pack, System, Operator ID and Self-ID only once received
+static constexpr MessageType PACKED_MESSAGES[] = {
+	MessageType::BasicId,
+	MessageType::Location,
+	MessageType::System,
+	MessageType::OperatorId,
+	MessageType::SelfId,
+};
+
+enum class AdvertisingMode {
+	Toggle,     // Alternate between legacy and extended advertising, resetting the controller in between
+	Persistent, // One legacy and one extended set, configured once and only updated with new data
+	MultiSet,   // A legacy and an extended set per message type, interleaved by the controller
+	Auto,       // The fastest of the above the controller supports
+};
+
+const char* advertising_mode_name(AdvertisingMode mode);
+
+// Transports an adapter broadcasts on
+enum class AdapterRole {
+	Both,
+	Legacy,
+	Extended,
+};
+
+const char* adapter_role_name(AdapterRole role);
+
+struct AdapterSettings {
+	std::string device {}; // "sim" selects the simulated controller
+	AdapterRole role {};
+};
+
+// Broadcasts the Remote ID messages of its role on one Bluetooth adapter. Every adapter
+// has its own controller connection, schedule and copy of the MAVLink data, so adapters
+// run from their own threads without waiting on each other. In relay mode it broadcasts
+// for every UAS it receives, each scheduled message going to the UAS in turn.
+class Broadcaster
+{
+public:
+	// mac is the random static address of the UAS and relay_macs that of each relayed system ID,
+	// the same on every adapter so receivers see each UAS once
+	Broadcaster(const Settings& settings, const AdapterSettings& adapter, const std::string& mac,
+		    const std::map<uint8_t, std::string>& relay_macs);
+
+	bool initialize();
+
+	// Broadcast loop, returns once stopped and advertising is disabled
+	void run();
+	// Only sets the exit flag, safe to call from a signal handler
+	void stop() { _should_exit.store(true); };
+
+	void request_stats() { _stats_requested.store(true); };
+
+	// Called from the MAVLink receive thread. False if the message is not broadcast.
+	bool update(const mavlink_message_t& message);
+
+	const AdapterSettings& adapter() const { return _adapter; };
+	bool broadcasts(Transport transport) const;
+
+private:
+	using Clock = BroadcastScheduler::Clock;
+
+	volatile std::atomic<bool> _should_exit {};
+	std::atomic<bool> _stats_requested {};
+
+	const Settings& _settings;
+	AdapterSettings _adapter {};
+	std::string _mac {};
+	const std::map<uint8_t, std::string>& _relay_macs;
+
+	// Bluetooth interface
+	std::shared_ptr<bt::Bluetooth> _bluetooth {};
+	std::shared_ptr<bt::SimulatedController> _simulator {};
+
+	// Encoded command per scheduled message, rebuilt when its source version changes
+	struct CachedFrame {
+		bool built {};
+		uint64_t version {};
+		Clock::time_point received {};
+		bt::AdvertisingDataFrame frame {};
+	};
+
+	// Everything broadcast for one UAS
+	struct Uas {
+		uint8_t sysid {};
+		std::string serial_number {};
+		// Random static address, empty to use the one all adapters share
+		std::string mac {};
+
+		// Mavlink message data, written by the MAVLink receive thread and read by the broadcast loop.
+		// System, Operator ID and Self-ID are only broadcast once received.
+		TripleBuffer<mavlink_heartbeat_t> heartbeat_msg;
+		TripleBuffer<mavlink_open_drone_id_location_t> location_msg;
+		TripleBuffer<mavlink_open_drone_id_system_t> system_msg;
+		TripleBuffer<mavlink_open_drone_id_operator_id_t> operator_id_msg;
+		TripleBuffer<mavlink_open_drone_id_self_id_t> self_id_msg;
+
+		// Each message has a unique counter
+		uint8_t msg_counters[MESSAGE_TYPES] {};
+
+		// Broadcast loop only
+		std::vector<CachedFrame> frames;
+	};
+
+	// One entry per MAVLink system in relay mode, otherwise only the autopilot. Allocated up front and
+	// only appended to, the broadcast loop reads the first _uas_count entries while new ones are added.
+	std::unique_ptr<Uas[]> _uas;
+	size_t _max_uas {};
+	std::atomic<size_t> _uas_count {};
+	// MAVLink receive thread only
+	int16_t _uas_index[256] {};
+	std::bitset<256> _uas_ignored {};
+	Uas* find_uas(uint8_t sysid);
+
+	// Round robin position per scheduled message
+	std::vector<size_t> _next_uas;
+	// UAS whose address each advertising channel carries, -1 for the adapter's own
+	std::vector<int> _channel_uas;
+	// Number of UAS the schedule rates are scaled for
+	size_t _scheduled_uas {1};
+
+	// Message pack fits into the controller's advertising data
+	bool _use_message_pack {};
+	// The configured mode, or what the controller supports best
+	AdvertisingMode _mode {};
+	AdvertisingMode select_advertising_mode(size_t messages) const;
+
+	// Deadlines for every message on every transport
+	BroadcastScheduler _scheduler;
+	void setup_schedule();
+
+	// Lateness of the broadcast loop waking up for its next deadline, the scheduling jitter of the host
+	LatencyHistogram _wakeup_latency;
+
+	// Time to the first advertisement, broadcasting starts before MAVLink is connected
+	Clock::time_point _created {};
+	bool _first_sent {};
+
+	// Toggle mode: transport currently advertising
+	std::optional<Transport> _toggle_transport {};
+
+	// Persistent and multi set modes
+	std::vector<bt::AdvertisingSet> _advertising_sets;
+	void setup_advertising_sets();
+
+	// Sets whose message goes out on a periodic advertising train, by handle
+	std::bitset<bt::Bluetooth::MAX_ADVERTISING_SETS> _periodic_sets {};
+	// Interval of the train carrying the message, 0 if it cannot have one
+	uint16_t periodic_interval_ms(const ScheduledMessage& message) const;
+
+	// Sum of the snapshot versions the message is encoded from
+	uint64_t source_version(Uas& uas, MessageType type);
+	// Returns when the MAVLink data was received, the epoch if it never was
+	Clock::time_point update_uas_data(Uas& uas, MessageType type, struct ODID_UAS_Data* data);
+	// False when there is nothing to send, e.g. Operator ID was not received yet
+	bool encode_message(MessageType type, struct ODID_UAS_Data* data, ODID_Message_encoded* encoded);
+	// Packs Basic ID, Location/Vector and, when available, System, Operator ID and Self-ID
+	bool encode_message_pack(struct ODID_UAS_Data* data, ODID_MessagePack_encoded* pack);
+	bool message_pack_fits();
+
+	bool build_frame(Uas& uas, const ScheduledMessage& message, CachedFrame* cached);
+	void build_message_frame(const ScheduledMessage& message, const ODID_Message_encoded* encoded, bt::AdvertisingDataFrame* frame);
+
+	// Relay mode: the Location messages of all UAS that changed are encoded in one batch
+	struct PendingLocation {
+		size_t index;
+		uint64_t version;
+		Clock::time_point received;
+	};
+
+	LocationBatch _location_batch;
+	LocationBatchEncoder _location_encoder;
+	std::vector<PendingLocation> _pending_locations;
+	std::vector<ODID_Location_encoded> _encoded_locations;
+	std::unique_ptr<bool[]> _encoded_locations_ok;
+	void refresh_locations(const ScheduledMessage& message, size_t count);
+
+	// Sends the message for the next UAS that has something to send
+	bool send_message(const ScheduledMessage& message);
+	bool send_message(size_t index, const ScheduledMessage& message);
+
+	// Age of the MAVLink data when it was encoded and when the controller accepted it, per message and transport
+	struct DataAge {
+		LatencyHistogram encoded;
+		LatencyHistogram acknowledged;
+	};
+	DataAge _data_age[MESSAGE_TYPES][2] {};
+	void print_data_age();
+	void print_stats();
+};
+
+} // end namespace txr
@@ -0,0 +1,351 @@
+#include "LocationBatch.hpp"
+#include "OdidConversion.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+
+namespace txr
+{
+
+void LocationBatch::clear()
+{
+	status.clear();
+	direction.clear();
+	speed_horizontal.clear();
+	speed_vertical.clear();
+	latitude.clear();
+	longitude.clear();
+	altitude_barometric.clear();
+	altitude_geodetic.clear();
+	height_reference.clear();
+	height.clear();
+	horizontal_accuracy.clear();
+	vertical_accuracy.clear();
+	barometer_accuracy.clear();
+	speed_accuracy.clear();
+	timestamp_accuracy.clear();
+	timestamp.clear();
+}
+
+void LocationBatch::push_back(const mavlink_open_drone_id_location_t& location)
+{
+	status.push_back(location.status);
+	direction.push_back(location.direction);
+	speed_horizontal.push_back(location.speed_horizontal);
+	speed_vertical.push_back(location.speed_vertical);
+	latitude.push_back(location.latitude);
+	longitude.push_back(location.longitude);
+	altitude_barometric.push_back(location.altitude_barometric);
+	altitude_geodetic.push_back(location.altitude_geodetic);
+	height_reference.push_back(location.height_reference);
+	height.push_back(location.height);
+	horizontal_accuracy.push_back(location.horizontal_accuracy);
+	vertical_accuracy.push_back(location.vertical_accuracy);
+	barometer_accuracy.push_back(location.barometer_accuracy);
+	speed_accuracy.push_back(location.speed_accuracy);
+	timestamp_accuracy.push_back(location.timestamp_accuracy);
+	timestamp.push_back(location.timestamp);
+}
+
+static mavlink_open_drone_id_location_t batch_record(const LocationBatch& batch, size_t i)
+{
+	mavlink_open_drone_id_location_t location = {};
+	location.status = batch.status[i];
+	location.direction = batch.direction[i];
+	location.speed_horizontal = batch.speed_horizontal[i];
+	location.speed_vertical = batch.speed_vertical[i];
+	location.latitude = batch.latitude[i];
+	location.longitude = batch.longitude[i];
+	location.altitude_barometric = batch.altitude_barometric[i];
+	location.altitude_geodetic = batch.altitude_geodetic[i];
+	location.height_reference = batch.height_reference[i];
+	location.height = batch.height[i];
+	location.horizontal_accuracy = batch.horizontal_accuracy[i];
+	location.vertical_accuracy = batch.vertical_accuracy[i];
+	location.barometer_accuracy = batch.barometer_accuracy[i];
+	location.speed_accuracy = batch.speed_accuracy[i];
+	location.timestamp_accuracy = batch.timestamp_accuracy[i];
+	location.timestamp = batch.timestamp[i];
+	return location;
+}
+
+// roundf() for 0 <= x < 2^23, where x - trunc(x) is exact
+static inline int32_t round_positive(float x)
+{
+	int32_t truncated = int32_t(x);
+	return truncated + (x - float(truncated) >= 0.5f);
+}
+
+// Valid altitudes the library encodes without clamping, false for NaN
+static inline bool altitude_in_range(float altitude)
+{
+	return (altitude >= -1000.f) & (altitude <= 31767.5f);
+}
+
+// x where mask is 1, 0 where it is 0, as a bit operation so the compiler keeps loops branch free
+static inline float masked(float x, uint32_t mask)
+{
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	bits &= -mask;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+static void encode_altitudes(const float* __restrict in, const uint8_t* __restrict in_range, uint16_t* __restrict out, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		float value = masked(in[i], in_range[i]);
+		out[i] = uint16_t(int32_t((value + 1000.f) / 0.5f));
+	}
+}
+
+void LocationBatchEncoder::encode(const LocationBatch& batch, ODID_Location_encoded* out, bool* ok)
+{
+	size_t n = batch.size();
+
+	_in_range.resize(n);
+	_direction.resize(n);
+	_east_west.resize(n);
+	_speed_horizontal.resize(n);
+	_speed_multiplier.resize(n);
+	_speed_vertical.resize(n);
+	_latitude.resize(n);
+	_longitude.resize(n);
+	_altitude_barometric.resize(n);
+	_altitude_geodetic.resize(n);
+	_height.resize(n);
+	_timestamp.resize(n);
+
+	// Local restrict pointers, the compiler can't otherwise tell the arrays apart and leaves the loops scalar
+	uint8_t* __restrict in_range = _in_range.data();
+
+	// Records the quantization below covers: every field valid and none of them clamped
+	{
+		const uint8_t* __restrict status = batch.status.data();
+		const uint8_t* __restrict height_reference = batch.height_reference.data();
+		const uint8_t* __restrict horizontal_accuracy = batch.horizontal_accuracy.data();
+		const uint8_t* __restrict vertical_accuracy = batch.vertical_accuracy.data();
+		const uint8_t* __restrict barometer_accuracy = batch.barometer_accuracy.data();
+		const uint8_t* __restrict speed_accuracy = batch.speed_accuracy.data();
+		const uint8_t* __restrict timestamp_accuracy = batch.timestamp_accuracy.data();
+
+		for (size_t i = 0; i < n; i++) {
+			in_range[i] = (status[i] <= 15) & (height_reference[i] <= 1) & (horizontal_accuracy[i] <= 15) &
+				      (vertical_accuracy[i] <= 15) & (barometer_accuracy[i] <= 15) & (speed_accuracy[i] <= 15) &
+				      (timestamp_accuracy[i] <= 15);
+		}
+	}
+
+	{
+		const uint16_t* __restrict direction = batch.direction.data();
+		const uint16_t* __restrict speed_horizontal = batch.speed_horizontal.data();
+		const int16_t* __restrict speed_vertical = batch.speed_vertical.data();
+
+		for (size_t i = 0; i < n; i++) {
+			in_range[i] &= ((direction[i] <= 36000) | (direction[i] == 36100)) &
+				       ((speed_horizontal[i] <= 25425) | (speed_horizontal[i] == 25500)) &
+				       (speed_vertical[i] >= -6200) & ((speed_vertical[i] <= 6200) | (speed_vertical[i] == 6300));
+		}
+	}
+
+	{
+		const int32_t* __restrict latitude = batch.latitude.data();
+		const int32_t* __restrict longitude = batch.longitude.data();
+		const float* __restrict barometric = batch.altitude_barometric.data();
+		const float* __restrict geodetic = batch.altitude_geodetic.data();
+		const float* __restrict height = batch.height.data();
+		const float* __restrict timestamp = batch.timestamp.data();
+
+		for (size_t i = 0; i < n; i++) {
+			in_range[i] &= (latitude[i] >= -900000000) & (latitude[i] <= 900000000) &
+				       (longitude[i] >= -1800000000) & (longitude[i] <= 1800000000) &
+				       altitude_in_range(barometric[i]) & altitude_in_range(geodetic[i]) & altitude_in_range(height[i]) &
+				       (((timestamp[i] >= 0.f) & (timestamp[i] <= 3600.f)) | (timestamp[i] == 65535.f));
+		}
+	}
+
+	// The quantization loops repeat convert_location() and the library's arithmetic operation by operation,
+	// in the same precision, so every value rounds exactly the same way. Out of range records are
+	// computed too but replaced below.
+	{
+		const uint16_t* __restrict in = batch.direction.data();
+		uint8_t* __restrict direction = _direction.data();
+		uint8_t* __restrict east_west = _east_west.data();
+
+		for (size_t i = 0; i < n; i++) {
+			int32_t degrees = round_positive(float(in[i]) / 100.f);
+			int32_t west = degrees >= 180;
+			direction[i] = uint8_t(degrees - 180 * west);
+			east_west[i] = uint8_t(west);
+		}
+	}
+
+	{
+		const uint16_t* __restrict in = batch.speed_horizontal.data();
+		uint8_t* __restrict speed = _speed_horizontal.data();
+		uint8_t* __restrict multiplier = _speed_multiplier.data();
+
+		for (size_t i = 0; i < n; i++) {
+			float value = float(in[i]) / 100.f;
+			int32_t fast = value > 255 * 0.25f;
+			int32_t slow_value = int32_t(value / 0.25f);
+			int32_t fast_value = int32_t((value - 255 * 0.25f) / 0.75f);
+			speed[i] = uint8_t(slow_value + fast * (fast_value - slow_value));
+			multiplier[i] = uint8_t(fast);
+		}
+	}
+
+	{
+		const int16_t* __restrict in = batch.speed_vertical.data();
+		int8_t* __restrict speed = _speed_vertical.data();
+
+		for (size_t i = 0; i < n; i++) {
+			speed[i] = int8_t(int32_t(float(in[i]) / 100.f / 0.5f));
+		}
+	}
+
+	{
+		const int32_t* __restrict latitude_in = batch.latitude.data();
+		const int32_t* __restrict longitude_in = batch.longitude.data();
+		int32_t* __restrict latitude = _latitude.data();
+		int32_t* __restrict longitude = _longitude.data();
+
+		for (size_t i = 0; i < n; i++) {
+			latitude[i] = int32_t(double(latitude_in[i]) / 1.e7 * 10000000);
+			longitude[i] = int32_t(double(longitude_in[i]) / 1.e7 * 10000000);
+		}
+	}
+
+	// Out of range floats are zeroed first, NaN and infinity must not be converted to integers
+	encode_altitudes(batch.altitude_barometric.data(), in_range, _altitude_barometric.data(), n);
+	encode_altitudes(batch.altitude_geodetic.data(), in_range, _altitude_geodetic.data(), n);
+	encode_altitudes(batch.height.data(), in_range, _height.data(), n);
+
+	{
+		const float* __restrict in = batch.timestamp.data();
+		uint16_t* __restrict timestamp = _timestamp.data();
+
+		for (size_t i = 0; i < n; i++) {
+			uint32_t invalid = in[i] == 65535.f;
+			float value = masked(in[i], in_range[i] & (invalid ^ 1));
+			uint32_t tenths = uint32_t(round_positive(value * 10));
+			timestamp[i] = uint16_t(tenths | (0xffff * invalid));
+		}
+	}
+
+	static_assert(sizeof(ODID_Location_encoded) == 25, "Location message layout");
+
+	// Interleave into the packed message layout
+	for (size_t i = 0; i < n; i++) {
+		if (!in_range[i]) {
+			ODID_Location_data data = {};
+			convert_location(batch_record(batch, i), &data);
+			ok[i] = encodeLocationMessage(&out[i], &data) == ODID_SUCCESS;
+			continue;
+		}
+
+		// Written byte by byte in the wire layout, storing to the packed bit fields one at a time
+		// takes longer than all the quantization loops together. Multi byte fields are little
+		// endian on air, the same as in memory on every target the library supports.
+		uint8_t* bytes = (uint8_t*)&out[i];
+		bytes[0] = (ODID_MESSAGETYPE_LOCATION << 4) | ODID_PROTOCOL_VERSION;
+		bytes[1] = (batch.status[i] << 4) | (batch.height_reference[i] << 2) | (_east_west[i] << 1) | _speed_multiplier[i];
+		bytes[2] = _direction[i];
+		bytes[3] = _speed_horizontal[i];
+		bytes[4] = uint8_t(_speed_vertical[i]);
+		memcpy(bytes + 5, &_latitude[i], 4);
+		memcpy(bytes + 9, &_longitude[i], 4);
+		memcpy(bytes + 13, &_altitude_barometric[i], 2);
+		memcpy(bytes + 15, &_altitude_geodetic[i], 2);
+		memcpy(bytes + 17, &_height[i], 2);
+		bytes[19] = (batch.vertical_accuracy[i] << 4) | batch.horizontal_accuracy[i];
+		bytes[20] = (batch.barometer_accuracy[i] << 4) | batch.speed_accuracy[i];
+		memcpy(bytes + 21, &_timestamp[i], 2);
+		bytes[23] = batch.timestamp_accuracy[i];
+		bytes[24] = 0;
+		ok[i] = true;
+	}
+}
+
+size_t LocationBatchEncoder::self_test(size_t samples, uint32_t seed)
+{
+	std::mt19937 random(seed);
+	auto pick = [&random](auto values) { return values[random() % values.size()]; };
+	auto uniform = [&random](double min, double max) { return std::uniform_real_distribution<double>(min, max)(random); };
+
+	// Quantization steps and the edges of the valid ranges
+	const std::vector<uint16_t> directions = { 0, 49, 50, 51, 17949, 17950, 17999, 18000, 18050, 35949, 35950, 36000, 36001, 36050, 36100, 36101, 65535 };
+	const std::vector<uint16_t> horizontal_speeds = { 0, 12, 13, 25, 6374, 6375, 6376, 6449, 6450, 25424, 25425, 25426, 25499, 25500, 25501, 65535 };
+	const std::vector<int16_t> vertical_speeds = { -32768, -6201, -6200, -51, -50, -49, 0, 49, 50, 51, 6200, 6201, 6299, 6300, 6301, 32767 };
+	const std::vector<int32_t> latitudes = { INT32_MIN, -900000001, -900000000, -1, 0, 1, 473977418, 900000000, 900000001, INT32_MAX };
+	const std::vector<int32_t> longitudes = { INT32_MIN, -1800000001, -1800000000, -1, 0, 1, 85455939, 1800000000, 1800000001, INT32_MAX };
+	const std::vector<float> altitudes = { -1000.5f, std::nextafter(-1000.f, -2000.f), -1000.f, -999.75f, -0.25f, 0.f, 0.25f, 0.5f,
+					       31767.5f, std::nextafter(31767.5f, 40000.f), 31768.f, std::numeric_limits<float>::quiet_NaN(),
+					       std::numeric_limits<float>::infinity()
+					     };
+	const std::vector<float> timestamps = { -1.f, std::nextafter(0.f, -1.f), 0.f, 0.04f, 0.05f, 0.15f, 0.25f, 3599.95f, 3600.f,
+						3600.1f, 65535.f, std::numeric_limits<float>::quiet_NaN()
+					      };
+	const std::vector<uint8_t> enums = { 0, 1, 2, 14, 15, 16, 255 };
+
+	LocationBatch batch;
+
+	for (size_t i = 0; i < samples; i++) {
+		// Mostly plausible flight data, every field at a boundary now and then
+		bool edge = random() % 2;
+		auto at_edge = [&]() { return edge && random() % 4 == 0; };
+
+		mavlink_open_drone_id_location_t location = {};
+		location.status = at_edge() ? pick(enums) : random() % 5;
+		location.direction = at_edge() ? pick(directions) : random() % 36001;
+		location.speed_horizontal = at_edge() ? pick(horizontal_speeds) : random() % 25426;
+		location.speed_vertical = at_edge() ? pick(vertical_speeds) : int16_t(int(random() % 12401) - 6200);
+		location.latitude = at_edge() ? pick(latitudes) : int32_t(uniform(-900000000, 900000000));
+		location.longitude = at_edge() ? pick(longitudes) : int32_t(uniform(-1800000000, 1800000000));
+
+		// Values on and next to the 0.5 m steps
+		auto altitude = [&]() {
+			float value = (random() % 65536) * 0.5f - 1000.f;
+			int nudge = random() % 3;
+			return nudge == 0 ? value : std::nextafter(value, nudge == 1 ? -2000.f : 40000.f);
+		};
+
+		location.altitude_barometric = at_edge() ? pick(altitudes) : altitude();
+		location.altitude_geodetic = at_edge() ? pick(altitudes) : altitude();
+		location.height = at_edge() ? pick(altitudes) : altitude();
+		location.height_reference = at_edge() ? pick(enums) : random() % 2;
+		location.horizontal_accuracy = at_edge() ? pick(enums) : random() % 13;
+		location.vertical_accuracy = at_edge() ? pick(enums) : random() % 7;
+		location.barometer_accuracy = at_edge() ? pick(enums) : random() % 7;
+		location.speed_accuracy = at_edge() ? pick(enums) : random() % 5;
+		location.timestamp_accuracy = at_edge() ? pick(enums) : random() % 16;
+		location.timestamp = at_edge() ? pick(timestamps) : float(uniform(0, 3600));
+		batch.push_back(location);
+	}
+
+	std::vector<ODID_Location_encoded> encoded(samples);
+	std::unique_ptr<bool[]> ok(new bool[samples]);
+	LocationBatchEncoder encoder;
+	encoder.encode(batch, encoded.data(), ok.get());
+
+	size_t mismatches = 0;
+
+	for (size_t i = 0; i < samples; i++) {
+		ODID_Location_data data = {};
+		ODID_Location_encoded reference = {};
+		convert_location(batch_record(batch, i), &data);
+		bool reference_ok = encodeLocationMessage(&reference, &data) == ODID_SUCCESS;
+
+		if (ok[i] != reference_ok || (reference_ok && memcmp(&encoded[i], &reference, sizeof(reference)))) {
+			mismatches++;
+		}
+	}
+
+	return mismatches;
+}
+
+} // end namespace txr
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <mavsdk/plugins/mavlink_passthrough/mavlink_passthrough.h>
+#include <opendroneid.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace txr
+{
+
+// OPEN_DRONE_ID_LOCATION fields of many UAS, one array per field
+struct LocationBatch {
+	std::vector<uint8_t> status;
+	std::vector<uint16_t> direction;        // cdeg
+	std::vector<uint16_t> speed_horizontal; // cm/s
+	std::vector<int16_t> speed_vertical;    // cm/s
+	std::vector<int32_t> latitude;          // degE7
+	std::vector<int32_t> longitude;         // degE7
+	std::vector<float> altitude_barometric;
+	std::vector<float> altitude_geodetic;
+	std::vector<uint8_t> height_reference;
+	std::vector<float> height;
+	std::vector<uint8_t> horizontal_accuracy;
+	std::vector<uint8_t> vertical_accuracy;
+	std::vector<uint8_t> barometer_accuracy;
+	std::vector<uint8_t> speed_accuracy;
+	std::vector<uint8_t> timestamp_accuracy;
+	std::vector<float> timestamp;
+
+	size_t size() const { return status.size(); };
+	void clear();
+	void push_back(const mavlink_open_drone_id_location_t& location);
+};
+
+// Converts and encodes a whole batch of Location/Vector messages, the same as convert_location()
+// followed by encodeLocationMessage() for each record. The quantization runs as branch free loops
+// over the field arrays that the compiler vectorizes. Records outside the ranges these loops cover,
+// e.g. invalid values the library rejects, go through the library encoder one by one.
+class LocationBatchEncoder
+{
+public:
+	// out and ok hold batch.size() records, ok is false where the library would fail to encode
+	void encode(const LocationBatch& batch, ODID_Location_encoded* out, bool* ok);
+
+	// Compares the batch encoder byte for byte with the library on random and boundary records,
+	// returns the number of records that differ
+	static size_t self_test(size_t samples, uint32_t seed = 1);
+
+private:
+	// Quantized fields, reused between batches
+	std::vector<uint8_t> _in_range;
+	std::vector<uint8_t> _direction;
+	std::vector<uint8_t> _east_west;
+	std::vector<uint8_t> _speed_horizontal;
+	std::vector<uint8_t> _speed_multiplier;
+	std::vector<int8_t> _speed_vertical;
+	std::vector<int32_t> _latitude;
+	std::vector<int32_t> _longitude;
+	std::vector<uint16_t> _altitude_barometric;
+	std::vector<uint16_t> _altitude_geodetic;
+	std::vector<uint16_t> _height;
+	std::vector<uint16_t> _timestamp;
+};
+
+} // end namespace txr
@@ -0,0 +1,182 @@
+#include "MavlinkLog.hpp"
+
+#include <global_include.hpp>
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace txr
+{
+
+static constexpr size_t padded(size_t length)
+{
+	return (length + 7) & ~size_t(7);
+}
+
+MavlinkRecorder::~MavlinkRecorder()
+{
+	close();
+}
+
+bool MavlinkRecorder::open(const std::string& path)
+{
+	_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+	if (_fd < 0) {
+		LOG(RED_TEXT "Failed to open MAVLink log %s: %s" NORMAL_TEXT, path.c_str(), strerror(errno));
+		return false;
+	}
+
+	if (::write(_fd, MAVLINK_LOG_MAGIC, sizeof(MAVLINK_LOG_MAGIC)) != sizeof(MAVLINK_LOG_MAGIC)) {
+		LOG(RED_TEXT "Failed to write MAVLink log %s" NORMAL_TEXT, path.c_str());
+		close();
+		return false;
+	}
+
+	_start = std::chrono::steady_clock::now();
+	LOG("Recording MAVLink to %s", path.c_str());
+	return true;
+}
+
+void MavlinkRecorder::close()
+{
+	if (_fd >= 0) {
+		::close(_fd);
+		_fd = -1;
+	}
+}
+
+void MavlinkRecorder::record(const mavlink_message_t& message)
+{
+	if (_fd < 0) {
+		return;
+	}
+
+	uint8_t buf[sizeof(MavlinkLogRecord) + padded(sizeof(message.payload64))] = {};
+	auto record = (MavlinkLogRecord*)buf;
+	record->time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+	record->msgid = message.msgid;
+	record->sysid = message.sysid;
+	record->compid = message.compid;
+	record->length = message.len;
+
+	memcpy(buf + sizeof(MavlinkLogRecord), message.payload64, message.len);
+
+	// One write per record keeps every record whole in the file
+	size_t size = sizeof(MavlinkLogRecord) + padded(message.len);
+
+	if (::write(_fd, buf, size) != ssize_t(size)) {
+		LOG(RED_TEXT "Failed to write MAVLink log, recording stopped" NORMAL_TEXT);
+		close();
+	}
+}
+
+MavlinkReplay::~MavlinkReplay()
+{
+	stop();
+
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+
+	if (_data) {
+		munmap((void*)_data, _size);
+	}
+}
+
+bool MavlinkReplay::open(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		LOG(RED_TEXT "Failed to open MAVLink log %s: %s" NORMAL_TEXT, path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st = {};
+	fstat(fd, &st);
+	_size = st.st_size;
+
+	if (_size < sizeof(MAVLINK_LOG_MAGIC)) {
+		LOG(RED_TEXT "MAVLink log %s is empty" NORMAL_TEXT, path.c_str());
+		::close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (data == MAP_FAILED) {
+		LOG(RED_TEXT "Failed to map MAVLink log %s" NORMAL_TEXT, path.c_str());
+		return false;
+	}
+
+	_data = (const uint8_t*)data;
+
+	if (memcmp(_data, MAVLINK_LOG_MAGIC, sizeof(MAVLINK_LOG_MAGIC))) {
+		LOG(RED_TEXT "%s is not a MAVLink log" NORMAL_TEXT, path.c_str());
+		return false;
+	}
+
+	// The whole log is read front to back
+	madvise(data, _size, MADV_SEQUENTIAL);
+	return true;
+}
+
+void MavlinkReplay::start(double speed, MessageHandler on_message, std::function<void()> on_done)
+{
+	_thread = std::thread(&MavlinkReplay::run, this, speed, std::move(on_message), std::move(on_done));
+}
+
+void MavlinkReplay::stop()
+{
+	_should_exit.store(true);
+
+	// on_done may stop us from the replay thread itself, the destructor joins in that case
+	if (_thread.joinable() && _thread.get_id() != std::this_thread::get_id()) {
+		_thread.join();
+	}
+}
+
+void MavlinkReplay::run(double speed, MessageHandler on_message, std::function<void()> on_done)
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t offset = sizeof(MAVLINK_LOG_MAGIC);
+	uint64_t count = 0;
+
+	while (!_should_exit && offset + sizeof(MavlinkLogRecord) <= _size) {
+		auto record = (const MavlinkLogRecord*)(_data + offset);
+		size_t size = sizeof(MavlinkLogRecord) + padded(record->length);
+
+		// Partially written last record
+		if (offset + size > _size) {
+			break;
+		}
+
+		if (speed > 0) {
+			auto due = start + std::chrono::nanoseconds(uint64_t(record->time_ns / speed));
+			std::this_thread::sleep_until(due);
+		}
+
+		mavlink_message_t message = {};
+		message.msgid = record->msgid;
+		message.sysid = record->sysid;
+		message.compid = record->compid;
+		message.len = record->length;
+		memcpy(message.payload64, _data + offset + sizeof(MavlinkLogRecord), record->length);
+
+		on_message(message);
+		offset += size;
+		count++;
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	LOG("Replayed %lu MAVLink messages in %.2f s", count, elapsed);
+
+	if (!_should_exit && on_done) on_done();
+}
+
+} // end namespace txr
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <mavsdk/plugins/mavlink_passthrough/mavlink_passthrough.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace txr
+{
+
+// Binary MAVLink log: an 8 byte magic followed by records, each a header and the message
+// payload padded to 8 bytes. Records are only ever appended, so a log cut short by a crash
+// replays up to its last complete record. The format is read in place through mmap.
+static constexpr char MAVLINK_LOG_MAGIC[8] = { 'R', 'I', 'D', 'M', 'A', 'V', '1', '\0' };
+
+struct MavlinkLogRecord {
+	uint64_t time_ns; // Monotonic time since the start of the recording
+	uint32_t msgid;
+	uint8_t sysid;
+	uint8_t compid;
+	uint8_t length; // Payload bytes following the header
+	uint8_t reserved;
+};
+
+static_assert(sizeof(MavlinkLogRecord) == 16, "log records must stay 8 byte aligned");
+
+class MavlinkRecorder
+{
+public:
+	~MavlinkRecorder();
+
+	bool open(const std::string& path);
+	void close();
+
+	// Called from the MAVLink receive thread
+	void record(const mavlink_message_t& message);
+
+private:
+	int _fd {-1};
+	std::chrono::steady_clock::time_point _start {};
+};
+
+class MavlinkReplay
+{
+public:
+	using MessageHandler = std::function<void(const mavlink_message_t& message)>;
+
+	~MavlinkReplay();
+
+	bool open(const std::string& path);
+
+	// Feeds the log to on_message on its own thread. speed 1 replays in real time, 0 as fast as possible.
+	// on_done is called from the replay thread once the log ends.
+	void start(double speed, MessageHandler on_message, std::function<void()> on_done);
+	void stop();
+
+private:
+	void run(double speed, MessageHandler on_message, std::function<void()> on_done);
+
+	const uint8_t* _data {};
+	size_t _size {};
+	std::atomic<bool> _should_exit {};
+	std::thread _thread;
+};
+
+} // end namespace txr
@@ -0,0 +1,392 @@
+#include "MavlinkReceiver.hpp"
+
+#include <global_include.hpp>
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace txr
+{
+
+// Identity the heartbeats are sent with, the Remote ID component of the vehicle
+static constexpr uint8_t SYSTEM_ID = 1;
+static constexpr uint8_t COMPONENT_ID = MAV_COMP_ID_ODID_TXRX_1;
+
+// CRC extra of the messages we broadcast from, false for everything else
+static bool accepted(uint32_t msgid, uint8_t* crc_extra)
+{
+	switch (msgid) {
+	case MAVLINK_MSG_ID_HEARTBEAT:
+		*crc_extra = MAVLINK_MSG_ID_HEARTBEAT_CRC;
+		return true;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_LOCATION:
+		*crc_extra = MAVLINK_MSG_ID_OPEN_DRONE_ID_LOCATION_CRC;
+		return true;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_SYSTEM:
+		*crc_extra = MAVLINK_MSG_ID_OPEN_DRONE_ID_SYSTEM_CRC;
+		return true;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_OPERATOR_ID:
+		*crc_extra = MAVLINK_MSG_ID_OPEN_DRONE_ID_OPERATOR_ID_CRC;
+		return true;
+
+	case MAVLINK_MSG_ID_OPEN_DRONE_ID_SELF_ID:
+		*crc_extra = MAVLINK_MSG_ID_OPEN_DRONE_ID_SELF_ID_CRC;
+		return true;
+	}
+
+	return false;
+}
+
+static speed_t baudrate_constant(int baudrate)
+{
+	switch (baudrate) {
+	case 9600:
+		return B9600;
+
+	case 19200:
+		return B19200;
+
+	case 38400:
+		return B38400;
+
+	case 57600:
+		return B57600;
+
+	case 115200:
+		return B115200;
+
+	case 230400:
+		return B230400;
+
+	case 460800:
+		return B460800;
+
+	case 921600:
+		return B921600;
+	}
+
+	return B0;
+}
+
+MavlinkReceiver::~MavlinkReceiver()
+{
+	stop();
+
+	if (_fd >= 0) {
+		::close(_fd);
+	}
+}
+
+bool MavlinkReceiver::open(const std::string& url)
+{
+	auto separator = url.find("://");
+
+	if (separator == std::string::npos) {
+		LOG(RED_TEXT "Invalid MAVLink connection %s" NORMAL_TEXT, url.c_str());
+		return false;
+	}
+
+	std::string scheme = url.substr(0, separator);
+	std::string address = url.substr(separator + 3);
+
+	if (scheme == "udp" || scheme == "udpin") {
+		return open_udp(address, true);
+
+	} else if (scheme == "udpout") {
+		return open_udp(address, false);
+
+	} else if (scheme == "serial") {
+		return open_serial(address);
+	}
+
+	LOG(RED_TEXT "Unsupported MAVLink connection %s" NORMAL_TEXT, url.c_str());
+	return false;
+}
+
+bool MavlinkReceiver::open_udp(const std::string& address, bool listen)
+{
+	auto separator = address.rfind(':');
+
+	if (separator == std::string::npos) {
+		LOG(RED_TEXT "Missing UDP port in %s" NORMAL_TEXT, address.c_str());
+		return false;
+	}
+
+	std::string host = address.substr(0, separator);
+	sockaddr_in endpoint = {};
+	endpoint.sin_family = AF_INET;
+	endpoint.sin_port = htons(atoi(address.c_str() + separator + 1));
+
+	if (host.empty()) {
+		host = "0.0.0.0";
+	}
+
+	if (inet_pton(AF_INET, host.c_str(), &endpoint.sin_addr) != 1) {
+		LOG(RED_TEXT "Invalid UDP address %s" NORMAL_TEXT, host.c_str());
+		return false;
+	}
+
+	_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (_fd < 0) {
+		LOG(RED_TEXT "Failed to create UDP socket: %s" NORMAL_TEXT, strerror(errno));
+		return false;
+	}
+
+	// Listen on the address, or send to it from any local port and take what comes back
+	if (listen) {
+		int reuse = 1;
+		setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		if (bind(_fd, (sockaddr*)&endpoint, sizeof(endpoint)) < 0) {
+			LOG(RED_TEXT "Failed to bind UDP %s: %s" NORMAL_TEXT, address.c_str(), strerror(errno));
+			return false;
+		}
+
+	} else {
+		_peer = endpoint;
+		_fixed_peer = true;
+	}
+
+	for (size_t i = 0; i < BATCH_SIZE; i++) {
+		_iovecs[i] = { _datagrams[i], DATAGRAM_SIZE };
+		_headers[i].msg_hdr.msg_iov = &_iovecs[i];
+		_headers[i].msg_hdr.msg_iovlen = 1;
+		_headers[i].msg_hdr.msg_name = &_senders[i];
+	}
+
+	LOG("Receiving MAVLink on udp %s", address.c_str());
+	return true;
+}
+
+bool MavlinkReceiver::open_serial(const std::string& device)
+{
+	// The baudrate follows the last colon, 57600 when there is none
+	auto separator = device.rfind(':');
+	std::string path = separator == std::string::npos ? device : device.substr(0, separator);
+	int baudrate = separator == std::string::npos ? 57600 : atoi(device.c_str() + separator + 1);
+	speed_t speed = baudrate_constant(baudrate);
+
+	if (speed == B0) {
+		LOG(RED_TEXT "Unsupported baudrate %d" NORMAL_TEXT, baudrate);
+		return false;
+	}
+
+	_fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+	if (_fd < 0) {
+		LOG(RED_TEXT "Failed to open %s: %s" NORMAL_TEXT, path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct termios options = {};
+
+	if (tcgetattr(_fd, &options) < 0) {
+		LOG(RED_TEXT "%s is not a serial device" NORMAL_TEXT, path.c_str());
+		return false;
+	}
+
+	cfmakeraw(&options);
+	cfsetispeed(&options, speed);
+	cfsetospeed(&options, speed);
+	options.c_cflag |= CLOCAL | CREAD;
+	options.c_cc[VMIN] = 0;
+	options.c_cc[VTIME] = 0;
+
+	if (tcsetattr(_fd, TCSANOW, &options) < 0) {
+		LOG(RED_TEXT "Failed to configure %s: %s" NORMAL_TEXT, path.c_str(), strerror(errno));
+		return false;
+	}
+
+	_serial = true;
+	LOG("Receiving MAVLink on %s at %d baud", path.c_str(), baudrate);
+	return true;
+}
+
+void MavlinkReceiver::start(MessageHandler on_message)
+{
+	_on_message = std::move(on_message);
+	_thread = std::thread(&MavlinkReceiver::run, this);
+}
+
+void MavlinkReceiver::stop()
+{
+	_should_exit.store(true);
+
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+void MavlinkReceiver::run()
+{
+	auto heartbeat_time = std::chrono::steady_clock::now();
+	send_heartbeat();
+
+	while (!_should_exit) {
+		// Wakes up at least every 100 ms to exit and send heartbeats
+		struct pollfd fd = { _fd, POLLIN, 0 };
+
+		if (poll(&fd, 1, 100) > 0) {
+			if (_serial) {
+				receive_serial();
+
+			} else {
+				receive_udp();
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+
+		if (now - heartbeat_time >= std::chrono::seconds(1)) {
+			send_heartbeat();
+			heartbeat_time = now;
+		}
+	}
+
+	LOG("Received %lu MAVLink messages in %lu reads, %lu CRC errors", _frames, _reads, _crc_errors);
+}
+
+void MavlinkReceiver::receive_udp()
+{
+	for (size_t i = 0; i < BATCH_SIZE; i++) {
+		_headers[i].msg_hdr.msg_namelen = sizeof(_senders[i]);
+	}
+
+	// Everything that queued up since the last wake up in one system call
+	int count = recvmmsg(_fd, _headers, BATCH_SIZE, MSG_DONTWAIT, nullptr);
+
+	if (count <= 0) {
+		return;
+	}
+
+	_reads++;
+
+	for (int i = 0; i < count; i++) {
+		parse(_datagrams[i], _headers[i].msg_len);
+	}
+
+	if (!_fixed_peer) {
+		_peer = _senders[count - 1];
+	}
+}
+
+void MavlinkReceiver::receive_serial()
+{
+	ssize_t length = ::read(_fd, _stream + _stream_size, sizeof(_stream) - _stream_size);
+
+	if (length <= 0) {
+		return;
+	}
+
+	_reads++;
+	_stream_size += length;
+
+	// Keep the partial frame at the end for the next read
+	size_t consumed = parse(_stream, _stream_size);
+	_stream_size -= consumed;
+	memmove(_stream, _stream + consumed, _stream_size);
+}
+
+size_t MavlinkReceiver::parse(const uint8_t* data, size_t size)
+{
+	size_t offset = 0;
+
+	while (offset < size) {
+		// Synchronize on the next start marker, MAVLink v1 frames are skipped with the noise
+		auto start = (const uint8_t*)memchr(data + offset, MAVLINK_STX, size - offset);
+
+		if (!start) {
+			return size;
+		}
+
+		offset = start - data;
+
+		if (size - offset < MAVLINK_NUM_HEADER_BYTES) {
+			break;
+		}
+
+		const uint8_t* frame = data + offset;
+
+		// Flags no MAVLink version defines, a start marker in the middle of other data
+		if (frame[2] & ~MAVLINK_IFLAG_MASK) {
+			offset++;
+			continue;
+		}
+
+		uint8_t length = frame[1];
+		bool is_signed = frame[2] & MAVLINK_IFLAG_SIGNED;
+		uint32_t msgid = frame[7] | (frame[8] << 8) | (frame[9] << 16);
+		size_t frame_size = MAVLINK_NUM_HEADER_BYTES + length + MAVLINK_NUM_CHECKSUM_BYTES +
+				    (is_signed ? MAVLINK_SIGNATURE_BLOCK_LEN : 0);
+
+		if (size - offset < frame_size) {
+			break;
+		}
+
+		uint8_t crc_extra = 0;
+
+		// Other messages are stepped over unchecked, like MAVLink's own parser a corrupted length
+		// loses the frames it covers until the stream is in sync again
+		if (!accepted(msgid, &crc_extra)) {
+			offset += frame_size;
+			continue;
+		}
+
+		uint16_t crc = crc_calculate(frame + 1, MAVLINK_CORE_HEADER_LEN + length);
+		crc_accumulate(crc_extra, &crc);
+		const uint8_t* checksum = frame + MAVLINK_NUM_HEADER_BYTES + length;
+
+		if (crc != (checksum[0] | (checksum[1] << 8))) {
+			// Not a frame after all, or a corrupted one, look for the next marker after this one
+			_crc_errors++;
+			offset++;
+			continue;
+		}
+
+		_message.magic = MAVLINK_STX;
+		_message.len = length;
+		_message.incompat_flags = frame[2];
+		_message.compat_flags = frame[3];
+		_message.seq = frame[4];
+		_message.sysid = frame[5];
+		_message.compid = frame[6];
+		_message.msgid = msgid;
+		_message.checksum = crc;
+		memcpy(_message.payload64, frame + MAVLINK_NUM_HEADER_BYTES, length);
+
+		_frames++;
+		_on_message(_message);
+		offset += frame_size;
+	}
+
+	return offset;
+}
+
+void MavlinkReceiver::send_heartbeat()
+{
+	mavlink_message_t message = {};
+	mavlink_msg_heartbeat_pack(SYSTEM_ID, COMPONENT_ID, &message, MAV_TYPE_ODID, MAV_AUTOPILOT_INVALID, 0, 0, MAV_STATE_ACTIVE);
+
+	uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+	uint16_t length = mavlink_msg_to_send_buffer(buf, &message);
+
+	if (_serial) {
+		if (::write(_fd, buf, length) < 0) {
+			LOG(RED_TEXT "Failed to send heartbeat: %s" NORMAL_TEXT, strerror(errno));
+		}
+
+	} else if (_peer.sin_port) {
+		sendto(_fd, buf, length, 0, (sockaddr*)&_peer, sizeof(_peer));
+	}
+}
+
+} // end namespace txr
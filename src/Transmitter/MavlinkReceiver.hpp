@@ -0,0 +1,81 @@
+#pragma once
+
+#include <mavsdk/plugins/mavlink_passthrough/mavlink_passthrough.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace txr
+{
+
+// Receives MAVLink v2 straight from a UDP port or a serial device instead of through MAVSDK.
+// Frames are parsed in place in buffers allocated up front. Only HEARTBEAT and the
+// OPEN_DRONE_ID messages are checked and handed on, everything else is skipped on its ID.
+class MavlinkReceiver
+{
+public:
+	using MessageHandler = std::function<void(const mavlink_message_t& message)>;
+
+	~MavlinkReceiver();
+
+	// udp://[address]:port or udpin://address:port to listen, udpout://address:port to connect,
+	// serial://device[:baudrate]
+	bool open(const std::string& url);
+
+	// Calls on_message from the receive thread
+	void start(MessageHandler on_message);
+	void stop();
+
+private:
+	// Datagrams read per recvmmsg() call and the largest one kept
+	static constexpr size_t BATCH_SIZE = 16;
+	static constexpr size_t DATAGRAM_SIZE = 2048;
+
+	bool open_udp(const std::string& address, bool listen);
+	bool open_serial(const std::string& device);
+
+	void run();
+	void receive_udp();
+	void receive_serial();
+
+	// Hands on every complete frame, returns the bytes consumed. A frame cut off at the end is
+	// left for the next read on serial links, UDP datagrams always hold whole frames.
+	size_t parse(const uint8_t* data, size_t size);
+
+	// The autopilot only routes the OPEN_DRONE_ID messages to components it has heard from
+	void send_heartbeat();
+
+	int _fd {-1};
+	bool _serial {};
+	std::atomic<bool> _should_exit {};
+	std::thread _thread;
+	MessageHandler _on_message;
+
+	// UDP: where heartbeats go, the last sender unless connected to a fixed address
+	sockaddr_in _peer {};
+	bool _fixed_peer {};
+
+	uint8_t _datagrams[BATCH_SIZE][DATAGRAM_SIZE];
+	mmsghdr _headers[BATCH_SIZE] {};
+	iovec _iovecs[BATCH_SIZE] {};
+	sockaddr_in _senders[BATCH_SIZE] {};
+
+	// Serial: bytes read but not parsed yet, at most one partial frame
+	uint8_t _stream[DATAGRAM_SIZE];
+	size_t _stream_size {};
+
+	// Only touched by the receive thread, reused for every message
+	mavlink_message_t _message {};
+
+	uint64_t _frames {};
+	uint64_t _crc_errors {};
+	uint64_t _reads {};
+};
+
+} // end namespace txr
@@ -0,0 +1,63 @@
+#include "OdidConversion.hpp"
+
+#include <cstring>
+
+namespace txr
+{
+
+void convert_basic_id(const mavlink_heartbeat_t& heartbeat, const char* uas_serial_number, ODID_BasicID_data* basic_id)
+{
+	basic_id->IDType = (ODID_idtype_t)MAV_ODID_ID_TYPE_SERIAL_NUMBER;
+	basic_id->UAType = (ODID_uatype)heartbeat.type;
+	strcpy(basic_id->UASID, uas_serial_number);
+}
+
+void convert_location(const mavlink_open_drone_id_location_t& location, ODID_Location_data* data)
+{
+	data->Status = (ODID_status_t)location.status;
+	data->Direction = float(location.direction) / 100.f;
+	data->SpeedHorizontal = float(location.speed_horizontal) / 100.f;
+	data->SpeedVertical = float(location.speed_vertical) / 100.f;
+	data->Latitude = double(location.latitude) / 1.e7;
+	data->Longitude = double(location.longitude) / 1.e7;
+	data->AltitudeBaro = location.altitude_barometric;
+	data->AltitudeGeo = location.altitude_geodetic;
+	data->HeightType = (ODID_Height_reference)location.height_reference;
+	data->Height = location.height;
+	data->HorizAccuracy = (ODID_Horizontal_accuracy_t)location.horizontal_accuracy;
+	data->VertAccuracy = (ODID_Vertical_accuracy_t)location.vertical_accuracy;
+	data->BaroAccuracy = (ODID_Vertical_accuracy_t)location.barometer_accuracy;
+	data->SpeedAccuracy = (ODID_Speed_accuracy_t)location.speed_accuracy;
+	data->TSAccuracy = (ODID_Timestamp_accuracy_t)location.timestamp_accuracy;
+	data->TimeStamp = location.timestamp;
+}
+
+void convert_system(const mavlink_open_drone_id_system_t& system, ODID_System_data* data)
+{
+	data->OperatorLocationType = (ODID_operator_location_type_t)system.operator_location_type;
+	data->ClassificationType = (ODID_classification_type_t)system.classification_type;
+	data->OperatorLatitude = system.operator_latitude / 1.e7;
+	data->OperatorLongitude = system.operator_longitude / 1.e7;
+	data->AreaCount = system.area_count;
+	data->AreaRadius = system.area_radius;
+	data->AreaCeiling = system.area_ceiling;
+	data->AreaFloor = system.area_floor;
+	data->CategoryEU = (ODID_category_EU_t)system.category_eu;
+	data->ClassEU = (ODID_class_EU_t)system.class_eu;
+	data->OperatorAltitudeGeo = system.operator_altitude_geo;
+	data->Timestamp = system.timestamp;
+}
+
+void convert_operator_id(const mavlink_open_drone_id_operator_id_t& operator_id, ODID_OperatorID_data* data)
+{
+	data->OperatorIdType = (ODID_operatorIdType_t)operator_id.operator_id_type;
+	memcpy(data->OperatorId, operator_id.operator_id, sizeof(operator_id.operator_id));
+}
+
+void convert_self_id(const mavlink_open_drone_id_self_id_t& self_id, ODID_SelfID_data* data)
+{
+	data->DescType = (ODID_desctype_t)self_id.description_type;
+	memcpy(data->Desc, self_id.description, sizeof(self_id.description));
+}
+
+} // end namespace txr
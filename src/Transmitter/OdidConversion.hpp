@@ -0,0 +1,16 @@
+#pragma once
+
+#include <mavsdk/plugins/mavlink_passthrough/mavlink_passthrough.h>
+#include <opendroneid.h>
+
+namespace txr
+{
+
+// MAVLink HEARTBEAT and OPEN_DRONE_ID_* messages to the opendroneid message data
+void convert_basic_id(const mavlink_heartbeat_t& heartbeat, const char* uas_serial_number, ODID_BasicID_data* basic_id);
+void convert_location(const mavlink_open_drone_id_location_t& location, ODID_Location_data* data);
+void convert_system(const mavlink_open_drone_id_system_t& system, ODID_System_data* data);
+void convert_operator_id(const mavlink_open_drone_id_operator_id_t& operator_id, ODID_OperatorID_data* data);
+void convert_self_id(const mavlink_open_drone_id_self_id_t& self_id, ODID_SelfID_data* data);
+
+} // end namespace txr
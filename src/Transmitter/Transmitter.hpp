@@ -1,13 +1,17 @@
 #pragma once
 
-#include <Bluetooth.hpp>
+#include <Broadcaster.hpp>
+#include <MavlinkLog.hpp>
+#include <MavlinkReceiver.hpp>
+#include <realtime.hpp>
 
 #include <mavsdk/mavsdk.h>
 #include <mavsdk/plugins/mavlink_passthrough/mavlink_passthrough.h>
 
+#include <map>
 #include <memory>
-#include <mutex>
 #include <functional>
+#include <optional>
 #include <unordered_map>
 #include <thread>
 
@@ -17,11 +21,47 @@
 namespace txr
 {
 
+static constexpr uint16_t MAVLINK_MESSAGE_IDS[] = {
+	MAVLINK_MSG_ID_HEARTBEAT,
+	MAVLINK_MSG_ID_OPEN_DRONE_ID_LOCATION,
+	MAVLINK_MSG_ID_OPEN_DRONE_ID_SYSTEM,
+	MAVLINK_MSG_ID_OPEN_DRONE_ID_OPERATOR_ID,
+	MAVLINK_MSG_ID_OPEN_DRONE_ID_SELF_ID,
+};
+
 struct Settings {
 	// mavlink::ConfigurationSettings mavlink_settings {};
 	std::string mavsdk_connection_url;
-	std::string bluetooth_device {};
+	// Parse MAVLink from the connection ourselves instead of through MAVSDK, fewer threads and less memory
+	bool direct_mavlink {};
+	// One broadcast loop per adapter, e.g. legacy advertising on one and extended on the other
+	std::vector<AdapterSettings> adapters {};
 	std::string uas_serial_number {};
+	AdvertisingMode advertising_mode {};
+	// Controller capabilities are probed once per controller and firmware and kept here, empty = probe every start
+	std::string capability_cache_dir {};
+	// Persistent and multi set modes: sets stop advertising if they are not refreshed within this time. 0 = never.
+	uint16_t advertising_set_timeout_ms {};
+	// Send all messages as a single message pack over extended advertising when the controller allows it
+	bool message_pack {};
+	// Send the extended Location (or the pack carrying it) on a periodic advertising train of its own set
+	bool periodic_location {};
+	ScheduleSettings schedule {};
+	// Broadcast for every MAVLink system with a serial number below instead of only the autopilot with system ID 1
+	bool relay {};
+	size_t relay_max_uas {64};
+	std::map<uint8_t, std::string> relay_serial_numbers {}; // System ID -> UAS serial number
+	// Append every MAVLink message used for broadcasting to this log, empty = off
+	std::string record_file {};
+	// Broadcast a recorded log instead of connecting to an autopilot, empty = off
+	std::string replay_file {};
+	double replay_speed {1.0}; // 0 = as fast as possible
+	// Capture all HCI traffic of each adapter to <dir>/<device>.btsnoop, empty = off
+	std::string hci_capture_dir {};
+	uint32_t hci_capture_size_mb {16}; // All three rolling files together
+	bt::SimulatedControllerSettings simulator {};
+	// Broadcast and HCI event threads
+	RealtimeSettings realtime {};
 };
 
 class Transmitter
@@ -30,13 +70,16 @@ public:
 	Transmitter(const txr::Settings& settings);
 
 	bool start();
+	// Only sets the exit flags, safe to call from a signal handler. run_state_machine() then returns.
 	void stop();
 
 	void run_state_machine();
 
+	// Logs the broadcast, data age and HCI command statistics from the broadcast loops, safe to call from a signal handler
+	void request_stats();
+
 
 	// std::shared_ptr<mavlink::Mavlink> mavlink() { return _mavlink; };
-	std::shared_ptr<bt::Bluetooth> bluetooth() { return _bluetooth; };
 
 
 private:
@@ -45,33 +88,27 @@ private:
 	// App settings
 	Settings _settings {};
 
-	// Bluetooth interface
-	std::shared_ptr<bt::Bluetooth> _bluetooth {};
+	// Bluetooth adapters
+	std::vector<std::unique_ptr<Broadcaster>> _broadcasters;
+	// Every adapter advertises from this address, receivers group the messages of one UAS by it
+	std::string _mac {};
+	// Relay mode: System ID -> address of the relayed UAS
+	std::map<uint8_t, std::string> _relay_macs {};
 
 	// Mavlink interface
 	// std::shared_ptr<mavlink::Mavlink> _mavlink {};
 	std::shared_ptr<mavsdk::Mavsdk> _mavsdk;
 	std::shared_ptr<mavsdk::MavlinkPassthrough> _mavlink;
 
-	// Mavlink message data
-	std::mutex _heartbeat_mutex;
-	std::mutex _location_mutex;
-	std::mutex _system_mutex;
-	mavlink_heartbeat_t _heartbeat_msg {};
-	mavlink_open_drone_id_location_t _location_msg {};
-	mavlink_open_drone_id_system_t _system_msg {};
-
-	// Each message has a unique counter
-	int _basic_msg_counter {};
-	int _location_msg_counter {};
-	int _system_msg_counter {};
-
-	// Toggles between legacy and extended advertisements
-	bool _toggle_legacy {};
-
-	// Sends the Basic ID, Location/Vector, and System messages
-	void send_single_messages(struct ODID_UAS_Data* data);
+	// Hands the messages we broadcast from to every adapter and records them
+	void handle_mavlink_message(const mavlink_message_t& message);
+	MavlinkRecorder _recorder;
+	MavlinkReplay _replay;
+	MavlinkReceiver _receiver;
 
+	// Retries until connected or stopped, on its own thread so broadcasting does not wait for the autopilot
+	std::thread _connect_thread;
+	void connect_mavsdk();
 	bool wait_for_mavsdk_connection(double timeout_s);
 };
 
@@ -16,7 +16,7 @@ int main()
 {
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
-	setbuf(stdout, NULL); // Disable stdout buffering
+	signal(SIGUSR1, signal_handler); // Log statistics
 
 	// Two-tier config lookup: user override > deb-installed default
 	const std::string home = getenv("HOME") ? getenv("HOME") : "/tmp";
@@ -53,20 +53,157 @@ int main()
 
 	txr::Settings settings = {
 		.mavsdk_connection_url = config["connection_url"].value_or("udp://0.0.0.0:14553"),
-		.bluetooth_device = config["bluetooth_device"].value_or("hci0"),
 		.uas_serial_number = uas_serial_number,
+		.advertising_set_timeout_ms = config["advertising_set_timeout_ms"].value_or(uint16_t(0)),
+		.message_pack = config["message_pack"].value_or(false),
+		.periodic_location = config["periodic_location"].value_or(false),
+		.record_file = config["record_file"].value_or(""),
+		.replay_file = config["replay_file"].value_or(""),
+		.replay_speed = config["replay_speed"].value_or(1.0),
+		.hci_capture_dir = config["hci_capture_dir"].value_or(""),
+		.hci_capture_size_mb = config["hci_capture_size_mb"].value_or(uint32_t(16)),
 	};
 
+	// A single adapter or a list, each optionally followed by its role, e.g. ["hci0:legacy", "hci1:extended"].
+	// A device can also be a BD address, only a role at its end is split off.
+	std::vector<std::string> devices;
+
+	if (auto array = config["bluetooth_device"].as_array()) {
+		for (auto& device : *array) {
+			devices.push_back(device.value_or(""));
+		}
+
+	} else {
+		devices.push_back(config["bluetooth_device"].value_or("hci0"));
+	}
+
+	for (auto& device : devices) {
+		auto separator = device.rfind(':');
+		std::string role = separator == std::string::npos ? "" : device.substr(separator + 1);
+		txr::AdapterSettings adapter = { .device = device };
+
+		if (role == "legacy") {
+			adapter.role = txr::AdapterRole::Legacy;
+
+		} else if (role == "extended") {
+			adapter.role = txr::AdapterRole::Extended;
+
+		} else if (role != "both") {
+			settings.adapters.push_back(adapter);
+			continue;
+		}
+
+		adapter.device = device.substr(0, separator);
+		settings.adapters.push_back(adapter);
+	}
+
+	std::string mavlink_ingest = config["mavlink_ingest"].value_or("mavsdk");
+
+	if (mavlink_ingest == "direct") {
+		settings.direct_mavlink = true;
+
+	} else if (mavlink_ingest != "mavsdk") {
+		std::cerr << "Error: unknown mavlink_ingest " << mavlink_ingest << std::endl;
+		return -1;
+	}
+
+	std::string advertising_mode = config["advertising_mode"].value_or("toggle");
+
+	if (advertising_mode == "persistent") {
+		settings.advertising_mode = txr::AdvertisingMode::Persistent;
+
+	} else if (advertising_mode == "multi_set") {
+		settings.advertising_mode = txr::AdvertisingMode::MultiSet;
+
+	} else if (advertising_mode == "auto") {
+		settings.advertising_mode = txr::AdvertisingMode::Auto;
+
+	} else if (advertising_mode != "toggle") {
+		std::cerr << "Error: unknown advertising_mode " << advertising_mode << std::endl;
+		return -1;
+	}
+
+	// Per user unless configured, "" turns the cache off
+	settings.capability_cache_dir = config["capability_cache_dir"].value_or(home + "/.cache/ark/rid-transmitter");
+
+	// Broadcast rates per message and transport
+	auto& schedule = settings.schedule;
+	schedule.message_spacing_ms = config["message_spacing_ms"].value_or(schedule.message_spacing_ms);
+	schedule.deadline_tolerance_ms = config["deadline_tolerance_ms"].value_or(schedule.deadline_tolerance_ms);
+
+	auto parse_rates = [&config](const char* transport, txr::MessageRates& rates) {
+		auto table = config["rates"][transport];
+		rates.basic_id = table["basic_id"].value_or(rates.basic_id);
+		rates.location = table["location"].value_or(rates.location);
+		rates.system = table["system"].value_or(rates.system);
+		rates.operator_id = table["operator_id"].value_or(rates.operator_id);
+		rates.self_id = table["self_id"].value_or(rates.self_id);
+		rates.pack = table["pack"].value_or(rates.pack);
+	};
+
+	parse_rates("legacy", schedule.legacy);
+	parse_rates("extended", schedule.extended);
+
+	// Relay mode, serial numbers per MAVLink system ID with the configured manufacturer code
+	settings.relay = config["relay"]["enabled"].value_or(false);
+	settings.relay_max_uas = config["relay"]["max_uas"].value_or(settings.relay_max_uas);
+
+	if (auto serial_numbers = config["relay"]["serial_numbers"].as_table()) {
+		for (auto& [sysid, serial] : *serial_numbers) {
+			int id = atoi(std::string(sysid.str()).c_str());
+
+			if (id < 1 || id > 255) {
+				std::cerr << "Error: invalid system ID " << sysid.str() << " in relay.serial_numbers" << std::endl;
+				return -1;
+			}
+
+			try {
+				settings.relay_serial_numbers[id] = generateUASSerialNumber(manufacturer_code, serial.value_or(""));
+
+			} catch (const std::invalid_argument& e) {
+				std::cerr << "Error: system " << id << ": " << e.what() << std::endl;
+				return -1;
+			}
+		}
+	}
+
+	settings.realtime.enabled = config["realtime"]["enabled"].value_or(false);
+	settings.realtime.priority = config["realtime"]["priority"].value_or(settings.realtime.priority);
+
+	if (auto cpus = config["realtime"]["cpus"].as_array()) {
+		for (auto& cpu : *cpus) {
+			settings.realtime.cpus.push_back(cpu.value_or(0));
+		}
+	}
+
+	// Only used when a bluetooth_device is "sim"
+	auto& sim = settings.simulator;
+	sim.command_latency_us = config["simulator"]["command_latency_us"].value_or(sim.command_latency_us);
+	sim.command_credits = config["simulator"]["command_credits"].value_or(sim.command_credits);
+	sim.le_features = config["simulator"]["le_features"].value_or(int64_t(sim.le_features));
+	sim.hci_features = config["simulator"]["hci_features"].value_or(int64_t(sim.hci_features));
+	sim.max_advertising_data_length = config["simulator"]["max_advertising_data_length"].value_or(sim.max_advertising_data_length);
+	sim.num_advertising_sets = config["simulator"]["num_advertising_sets"].value_or(sim.num_advertising_sets);
+	sim.spurious_data_complete = config["simulator"]["spurious_data_complete"].value_or(sim.spurious_data_complete);
+	sim.error_rate = config["simulator"]["error_rate"].value_or(sim.error_rate);
+	sim.drop_rate = config["simulator"]["drop_rate"].value_or(sim.drop_rate);
+	sim.error_status = config["simulator"]["error_status"].value_or(sim.error_status);
+	sim.error_opcode = config["simulator"]["error_opcode"].value_or(sim.error_opcode);
+
 	_transmitter = std::make_shared<txr::Transmitter>(settings);
 
 	if (!_transmitter->start()) {
 		LOG("Failed to start, exiting!");
+		_transmitter.reset();
 		exit(1);
 	}
 
 	// Only exits on Ctrl+C
 	_transmitter->run_state_machine();
 
+	// Destroyed here, the log a static destructor would run after is already gone
+	_transmitter.reset();
+
 	LOG("Exiting!");
 	return 0;
 }
@@ -75,5 +212,11 @@ static void signal_handler(int signum)
 {
 	LOG("signal_handler! %d", signum);
 
+	if (signum == SIGUSR1) {
+		if (_transmitter.get()) _transmitter->request_stats();
+
+		return;
+	}
+
 	if (_transmitter.get()) _transmitter->stop();
 }
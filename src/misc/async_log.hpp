@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+
+#include <unistd.h>
+
+// Asynchronous logging. LOG() only copies the format string pointer, a timestamp and the arguments
+// into a fixed size record of a lock-free ring, a background thread formats the records and writes
+// them to stdout in batches. Logging never blocks on the console or journald: when the ring is full
+// the record is dropped and counted. String arguments are copied, long ones are truncated.
+class AsyncLog
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static AsyncLog& instance()
+	{
+		static AsyncLog log;
+		return log;
+	}
+
+	template <typename... Args>
+	void record(const char* format, Args&& ... args)
+	{
+		size_t position = _enqueue_position.load(std::memory_order_relaxed);
+		Slot* slot;
+
+		// Claim the next free slot, bounded MPMC queue after Dmitry Vyukov
+		while (true) {
+			slot = &_slots[position & (CAPACITY - 1)];
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			intptr_t difference = intptr_t(sequence) - intptr_t(position);
+
+			if (difference == 0) {
+				if (_enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					break;
+				}
+
+			} else if (difference < 0) {
+				_dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+
+			} else {
+				position = _enqueue_position.load(std::memory_order_relaxed);
+			}
+		}
+
+		slot->time = Clock::now();
+		slot->format = format;
+		slot->formatter = &format_arguments<std::decay_t<Args>...>;
+		encode_arguments<std::decay_t<Args>...>(slot->arguments, args...);
+		slot->sequence.store(position + 1, std::memory_order_release);
+	}
+
+	// Blocks until everything logged so far is written, for output that bypasses the log
+	void flush()
+	{
+		size_t target = _enqueue_position.load(std::memory_order_acquire);
+
+		while (_written.load(std::memory_order_acquire) < target && _thread.joinable()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	~AsyncLog()
+	{
+		_should_exit.store(true);
+
+		if (_thread.joinable()) {
+			_thread.join();
+		}
+	}
+
+private:
+	// Records of 256 bytes, 256 KiB in total
+	static constexpr size_t CAPACITY = 1024;
+	static constexpr size_t ARGUMENTS_SIZE = 224;
+	static constexpr size_t LINE_SIZE = 512;
+	static constexpr size_t BATCH_SIZE = 64 * 1024;
+
+	using Formatter = int (*)(char* out, size_t size, const char* format, const uint8_t* arguments);
+
+	struct Slot {
+		std::atomic<size_t> sequence {};
+		Clock::time_point time {};
+		const char* format {};
+		Formatter formatter {};
+		uint8_t arguments[ARGUMENTS_SIZE];
+	};
+
+	static_assert(sizeof(Slot) == 256);
+
+	template <typename T>
+	static constexpr bool is_string = std::is_same_v<T, const char*> || std::is_same_v<T, char*>;
+
+	// Bytes an argument takes in the record, strings take their length and terminator on top
+	template <typename T>
+	static constexpr size_t fixed_size() { return is_string<T> ? sizeof(uint8_t) + 1 : sizeof(T); }
+
+	template <typename... Args>
+	static void encode_arguments([[maybe_unused]] uint8_t* cursor, const Args& ... args)
+	{
+		static_assert((fixed_size<Args>() + ... + 0) <= ARGUMENTS_SIZE, "Too many log arguments");
+		static_assert(((std::is_arithmetic_v<Args> || std::is_enum_v<Args> || std::is_pointer_v<Args>) && ...),
+			      "Only numbers, pointers and C strings can be logged");
+
+		// Strings share what the fixed size arguments leave
+		[[maybe_unused]] size_t available = ARGUMENTS_SIZE - (fixed_size<Args>() + ... + 0);
+		(encode_argument(cursor, available, args), ...);
+	}
+
+	template <typename T>
+	static void encode_argument(uint8_t*& cursor, size_t& available, const T& value)
+	{
+		if constexpr (is_string<T>) {
+			const char* string = value ? value : "(null)";
+			uint8_t length = strnlen(string, std::min<size_t>(available, UINT8_MAX));
+			available -= length;
+
+			*cursor++ = length;
+			memcpy(cursor, string, length);
+			cursor[length] = '\0';
+			cursor += length + 1;
+
+		} else {
+			memcpy(cursor, &value, sizeof(T));
+			cursor += sizeof(T);
+		}
+	}
+
+	template <typename T>
+	static auto decode_argument(const uint8_t*& cursor)
+	{
+		if constexpr (is_string<T>) {
+			const char* string = (const char*)cursor + 1;
+			cursor += *cursor + 2;
+			return string;
+
+		} else {
+			T value;
+			memcpy(&value, cursor, sizeof(T));
+			cursor += sizeof(T);
+			return value;
+		}
+	}
+
+	template <typename... Args>
+	static int format_arguments(char* out, size_t size, const char* format, [[maybe_unused]] const uint8_t* cursor)
+	{
+		// Braced initializers are evaluated in order
+		std::tuple<decltype(decode_argument<Args>(cursor))...> values { decode_argument<Args>(cursor)... };
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+		return std::apply([&](auto... arguments) { return snprintf(out, size, format, arguments...); }, values);
+#pragma GCC diagnostic pop
+	}
+
+	AsyncLog()
+	{
+		for (size_t i = 0; i < CAPACITY; i++) {
+			_slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		_thread = std::thread(&AsyncLog::run, this);
+	}
+
+	void run()
+	{
+		while (true) {
+			bool exiting = _should_exit.load();
+
+			// Everything logged before the exit request is still written
+			if (!drain() && exiting) {
+				break;
+			}
+
+			if (!exiting) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+		}
+
+		char line[LINE_SIZE];
+		int length = snprintf(line, sizeof(line), "Logged %zu lines, %zu dropped, up to %.1f ms behind\n", _written.load(),
+				      _dropped.load(), std::chrono::duration<double, std::milli>(_max_delay).count());
+		write_all(line, std::min<size_t>(length, sizeof(line) - 1));
+	}
+
+	// Formats all complete records into one write, returns false if there were none
+	bool drain()
+	{
+		size_t batch_length = 0;
+		size_t count = 0;
+
+		while (true) {
+			Slot& slot = _slots[_dequeue_position & (CAPACITY - 1)];
+
+			if (slot.sequence.load(std::memory_order_acquire) != _dequeue_position + 1) {
+				break;
+			}
+
+			if (batch_length + LINE_SIZE > BATCH_SIZE) {
+				write_all(_batch, batch_length);
+				batch_length = 0;
+			}
+
+			int length = slot.formatter(_batch + batch_length, LINE_SIZE - 1, slot.format, slot.arguments);
+			batch_length += std::clamp<int>(length, 0, LINE_SIZE - 2);
+			_batch[batch_length++] = '\n';
+			_max_delay = std::max(_max_delay, Clock::now() - slot.time);
+
+			slot.sequence.store(_dequeue_position + CAPACITY, std::memory_order_release);
+			_dequeue_position++;
+			count++;
+		}
+
+		write_all(_batch, batch_length);
+		_written.fetch_add(count, std::memory_order_release);
+		return count > 0;
+	}
+
+	static void write_all(const char* data, size_t length)
+	{
+		while (length > 0) {
+			ssize_t written = ::write(STDOUT_FILENO, data, length);
+
+			if (written <= 0) {
+				return;
+			}
+
+			data += written;
+			length -= written;
+		}
+	}
+
+	Slot _slots[CAPACITY];
+	alignas(64) std::atomic<size_t> _enqueue_position {};
+	alignas(64) std::atomic<size_t> _written {};
+	std::atomic<size_t> _dropped {};
+	std::atomic<bool> _should_exit {};
+
+	// Background thread only
+	size_t _dequeue_position {};
+	Clock::duration _max_delay {};
+	char _batch[BATCH_SIZE];
+	std::thread _thread;
+};
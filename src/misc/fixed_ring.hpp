@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <utility>
+
+// First in, first out queue of at most Capacity elements stored inline, nothing is allocated after
+// construction. Not thread safe. Removed slots keep their moved-from element until they are reused.
+template <typename T, size_t Capacity>
+class FixedRing
+{
+public:
+	// False when full, value is left untouched then
+	bool push_back(T&& value)
+	{
+		if (_size == Capacity) {
+			return false;
+		}
+
+		_slots[(_head + _size) % Capacity] = std::move(value);
+		_size++;
+		return true;
+	}
+
+	void pop_front()
+	{
+		_head = (_head + 1) % Capacity;
+		_size--;
+	}
+
+	// Removes the element at index, those behind it move up by one
+	void erase(size_t index)
+	{
+		for (size_t i = index; i + 1 < _size; i++) {
+			(*this)[i] = std::move((*this)[i + 1]);
+		}
+
+		_size--;
+	}
+
+	void clear()
+	{
+		_head = 0;
+		_size = 0;
+	}
+
+	// Index 0 is the oldest element
+	T& operator[](size_t index) { return _slots[(_head + index) % Capacity]; };
+	const T& operator[](size_t index) const { return _slots[(_head + index) % Capacity]; };
+	T& front() { return _slots[_head]; };
+
+	size_t size() const { return _size; };
+	bool empty() const { return _size == 0; };
+
+private:
+	std::array<T, Capacity> _slots {};
+	size_t _head {};
+	size_t _size {};
+};
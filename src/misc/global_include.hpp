@@ -1,5 +1,7 @@
 #pragma once
 
+#include <async_log.hpp>
+
 #include <chrono>
 
 #define NORMAL_TEXT "\033[0m" // Restore normal console colour
@@ -7,6 +9,7 @@
 #define RED_TEXT "\x1B[31m" // Turn text on console blue
 #define GREEN_TEXT "\u001b[32;1m" // Turn text on console green
 
-#define LOG(...) do { printf(__VA_ARGS__); puts(""); } while (0)
+// Queued for the background log thread, the dead printf() only keeps the format checked
+#define LOG(...) do { if (false) printf(__VA_ARGS__); AsyncLog::instance().record(__VA_ARGS__); } while (0)
 
-#define millis() std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count()
+#define millis() std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <global_include.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+
+// Lock-free latency histogram with four logarithmic buckets per power of two, so percentiles
+// are within about 20%. record() may be called from any thread.
+class LatencyHistogram
+{
+public:
+	void record(std::chrono::nanoseconds latency)
+	{
+		uint64_t ns = latency.count() > 0 ? latency.count() : 0;
+		_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		_count.fetch_add(1, std::memory_order_relaxed);
+
+		uint64_t max = _max.load(std::memory_order_relaxed);
+
+		while (ns > max && !_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+	}
+
+	uint64_t count() const { return _count.load(std::memory_order_relaxed); };
+	std::chrono::nanoseconds max() const { return std::chrono::nanoseconds(_max.load(std::memory_order_relaxed)); };
+
+	// Upper bound of the bucket holding the quantile, 0.5 for the median
+	std::chrono::nanoseconds percentile(double quantile) const
+	{
+		uint64_t target = std::ceil(quantile * count());
+		uint64_t seen = 0;
+
+		for (int i = 0; i < BUCKETS; i++) {
+			seen += _buckets[i].load(std::memory_order_relaxed);
+
+			if (seen >= target && seen > 0) {
+				return std::min(std::chrono::nanoseconds(bucket_upper(i)), max());
+			}
+		}
+
+		return max();
+	}
+
+	// One line summary in milliseconds
+	void log(const char* label) const
+	{
+		if (!count()) {
+			LOG("%s: no samples", label);
+			return;
+		}
+
+		LOG("%s: %lu samples, p50 %.2f ms, p99 %.2f ms, max %.2f ms", label, count(),
+		    to_ms(percentile(0.5)), to_ms(percentile(0.99)), to_ms(max()));
+	}
+
+private:
+	static constexpr int SUB_BUCKETS = 4;
+	static constexpr int BUCKETS = 64 * SUB_BUCKETS;
+
+	static double to_ms(std::chrono::nanoseconds ns) { return ns.count() / 1e6; };
+
+	// Values below 4 have their own bucket, above that the two bits after the leading one pick the sub bucket
+	static int bucket(uint64_t value)
+	{
+		if (value < SUB_BUCKETS) {
+			return value;
+		}
+
+		int exponent = 63 - __builtin_clzll(value);
+		int mantissa = value >> (exponent - 2);
+		return SUB_BUCKETS * (exponent - 2) + mantissa;
+	}
+
+	static uint64_t bucket_upper(int index)
+	{
+		if (index < SUB_BUCKETS) {
+			return index;
+		}
+
+		int exponent = index / SUB_BUCKETS + 1;
+		uint64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+		return ((mantissa + 1) << (exponent - 2)) - 1;
+	}
+
+	std::atomic<uint64_t> _buckets[BUCKETS] {};
+	std::atomic<uint64_t> _count {};
+	std::atomic<uint64_t> _max {};
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <global_include.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+// Scheduling of the threads on the broadcast path. The host may be busy with video encoding
+// or mapping, without a real-time profile the broadcast loop waits behind that work.
+struct RealtimeSettings {
+	bool enabled {};
+	int priority {50};      // SCHED_FIFO, 1 (lowest) to 99
+	std::vector<int> cpus;  // CPUs the threads may run on, empty = any
+};
+
+// Bytes of stack touched up front, so the first deep call on the broadcast path does not page fault
+static constexpr size_t PREFAULT_STACK_SIZE = 256 * 1024;
+
+// Keeps every current and future page of the process in RAM
+inline bool lock_memory()
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		LOG(RED_TEXT "mlockall failed: %s" NORMAL_TEXT, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+// Moves the thread to SCHED_FIFO at the configured priority and onto the configured CPUs.
+// Needs CAP_SYS_NICE or an rtprio limit, the thread keeps running unchanged otherwise.
+inline bool set_realtime_scheduling(pthread_t thread, const RealtimeSettings& settings, const char* name)
+{
+	bool ok = true;
+
+	if (!settings.cpus.empty()) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+
+		for (int cpu : settings.cpus) {
+			CPU_SET(cpu, &cpus);
+		}
+
+		int error = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+
+		if (error) {
+			LOG(RED_TEXT "%s: failed to set CPU affinity: %s" NORMAL_TEXT, name, strerror(error));
+			ok = false;
+		}
+	}
+
+	struct sched_param param = {};
+	param.sched_priority = settings.priority;
+	int error = pthread_setschedparam(thread, SCHED_FIFO, &param);
+
+	if (error) {
+		LOG(RED_TEXT "%s: failed to set SCHED_FIFO priority %d: %s" NORMAL_TEXT, name, settings.priority, strerror(error));
+		ok = false;
+	}
+
+	return ok;
+}
+
+// Call from the thread itself
+__attribute__((noinline)) inline void prefault_stack()
+{
+	volatile uint8_t stack[PREFAULT_STACK_SIZE];
+
+	for (size_t i = 0; i < sizeof(stack); i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+// Sleeps until an absolute CLOCK_MONOTONIC deadline, the time to the deadline is not recomputed after
+// a wake up so an interrupted sleep never drifts. steady_clock is CLOCK_MONOTONIC on Linux.
+inline void sleep_until_monotonic(std::chrono::steady_clock::time_point deadline)
+{
+	auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+
+	if (since_epoch <= 0) {
+		return;
+	}
+
+	struct timespec when = {};
+	when.tv_sec = since_epoch / 1000000000;
+	when.tv_nsec = since_epoch % 1000000000;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, nullptr) == EINTR) {}
+}
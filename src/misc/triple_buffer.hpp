@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Wait-free handoff of the latest value from one writer thread to one reader thread.
+// The writer fills the back buffer and swaps it with the middle one, the reader swaps
+// the middle buffer in when something new was published. Neither side ever waits for
+// the other and the reader always sees a complete value.
+template <typename T>
+class TripleBuffer
+{
+public:
+	struct Snapshot {
+		T value {};
+		// Increments with every publish, 0 until the first one
+		uint64_t version {};
+		// Monotonic time the value was published, i.e. received by the writer
+		std::chrono::steady_clock::time_point published {};
+	};
+
+	// Writer only. Fill the returned buffer, then publish it.
+	T& back() { return _slots[_back].value; };
+
+	void publish()
+	{
+		_slots[_back].version = ++_version;
+		_slots[_back].published = std::chrono::steady_clock::now();
+		_back = _middle.exchange(_back | DIRTY, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// Reader only. Latest published value, valid until the next call.
+	const Snapshot& read()
+	{
+		if (_middle.load(std::memory_order_relaxed) & DIRTY) {
+			_front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX;
+		}
+
+		return _slots[_front];
+	}
+
+private:
+	static constexpr uint8_t INDEX = 0x03;
+	static constexpr uint8_t DIRTY = 0x04;
+
+	struct alignas(64) Slot : Snapshot {};
+
+	Slot _slots[3] {};
+	alignas(64) std::atomic<uint8_t> _middle {1};
+	alignas(64) uint8_t _back {0};
+	uint64_t _version {};
+	alignas(64) uint8_t _front {2};
+};